@@ -3,6 +3,8 @@
 
 #include "../atomic/atomic.hh"
 #include "variable_allocator.hh"
+#include "log_allocator.hh"
+#include "../codec/codec.hh"
 #include <cassert>
 
 namespace iht {
@@ -37,11 +39,17 @@ namespace iht {
     public:
       // region: 割当に使用するメモリ領域。
       // size: regionのサイズ
-      FixedAllocator(void* region, uint32_t size) 
+      // policy: SINGLE_THREAD なら管理情報の更新にロック命令を使わない。(region を一つのスレッドからしか使わない場合のみ)
+      FixedAllocator(void* region, uint32_t size, atomic::Policy policy=atomic::MULTI_THREAD) 
         : super_blocks_(reinterpret_cast<SuperBlock*>(region)),
           base_alc_(super_blocks_+SUPER_BLOCK_COUNT, 
-                    size > SUPER_BLOCKS_SIZE ? size - SUPER_BLOCKS_SIZE : 0),
-          region_size_(size) {
+                    size > SUPER_BLOCKS_SIZE ? size - SUPER_BLOCKS_SIZE : 0,
+                    policy),
+          region_size_(size),
+          policy_(policy),
+          cold_region_(NULL),
+          codec_(NULL),
+          dedup_table_(0) {
       }
 
       operator bool() const { return super_blocks_ != NULL && base_alc_; }
@@ -81,15 +89,15 @@ namespace iht {
         SuperBlock& sb = super_blocks_[sb_id-1];
       
         // まずキャッシュからのブロック取得を試みる
-        for(Block head = atomic::fetch(&sb.head);
+        for(Block head = atomic::fetch(policy_, &sb.head);
             head.next != Block::END;
-            head = atomic::fetch(&sb.head)) {
+            head = atomic::fetch(policy_, &sb.head)) {
           Block block = *base_alc_.ptr<Block>(head.next);
           Block new_head = {block.next};
         
-          if(atomic::compare_and_swap(&sb.head, head, new_head)) {
-            atomic::add(&sb.used_count, 1);
-            atomic::sub(&sb.free_count, 1);
+          if(atomic::compare_and_swap(policy_, &sb.head, head, new_head)) {
+            atomic::add(policy_, &sb.used_count, 1);
+            atomic::sub(policy_, &sb.free_count, 1);
 
             return base_alc_.dupNew(head.next); // キャッシュから再利用
           }
@@ -101,7 +109,7 @@ namespace iht {
           return 0;
         }
 
-        atomic::add(&sb.used_count, 1);
+        atomic::add(policy_, &sb.used_count, 1);
         return md;
       }
       
@@ -139,23 +147,23 @@ namespace iht {
         // キャッシュに溜めておく必要がないなら、ブロックを解放する
         if(sb.used_count < sb.free_count &&
            base_alc_.lightRelease(md)) {
-          atomic::sub(&sb.used_count, 1);
+          atomic::sub(policy_, &sb.used_count, 1);
           return true;
         }
         
         // キャッシュが不足しているか、高競合下によりブロック解放に失敗した場合は、キャッシュに追加する
         for(;;) {
-          Block head = atomic::fetch(&sb.head);
+          Block head = atomic::fetch(policy_, &sb.head);
           Block new_head = {md};
           base_alc_.ptr<Block>(new_head.next)->next = head.next;
           
-          if(atomic::compare_and_swap(&sb.head, head, new_head)) {
+          if(atomic::compare_and_swap(policy_, &sb.head, head, new_head)) {
             break;
           }
         }
 
-        atomic::sub(&sb.used_count, 1);
-        atomic::add(&sb.free_count, 1);
+        atomic::sub(policy_, &sb.used_count, 1);
+        atomic::add(policy_, &sb.free_count, 1);
 
         return true;
       }
@@ -164,6 +172,48 @@ namespace iht {
         return base_alc_.dup(md, delta);
       }
 
+      // 使用中の固定長ブロックの合計バイト数を返す。(キャッシュ中のブロックや、VariableAllocator から直接割り当てた領域は含まない)
+      // 他のスレッドが割当・解放中の場合は近似値となる。
+      uint64_t allocatedBytes() const {
+        uint64_t bytes = 0;
+        for(uint32_t i=0; i < SUPER_BLOCK_COUNT; i++) {
+          bytes += static_cast<uint64_t>(super_blocks_[i].used_count) * super_blocks_[i].block_size;
+        }
+        return bytes;
+      }
+
+      // size バイトの割当要求に対して実際に確保されるバイト数 (ブロックサイズ、またはチャンク単位への切り上げ)
+      static uint32_t blockSize(uint32_t size) {
+        if(size > BLOCK_SIZE_LAST) {
+          return (size + BLOCK_SIZE_START - 1) / BLOCK_SIZE_START * BLOCK_SIZE_START;
+        }
+        uint32_t block_size = BLOCK_SIZE_START;
+        while(block_size < size) {
+          block_size *= 2;
+        }
+        return block_size;
+      }
+
+      // 合計 size バイト(ブロックサイズへの切り上げ後)までの割当が、キャッシュを使わずとも確実に成功するかどうかを返す。
+      // (その大きさの連続した空き領域があるかを調べるだけで、実際には割り当てない)
+      // 書き込み側が直列化されている場合にのみ、続く割当の成否の判断に使える。
+      bool hasRoom(uint64_t size) {
+        return size <= 0xFFFFFFFF && base_alc_.hasRoom(size);
+      }
+
+      // 大きな値を置くための(ファイルに対応付けられた)別領域を設定する。(NULL なら使わない)
+      // 領域はプロセス毎に設定するものなので、同じテーブルを使う全てのプロセスで同じ領域を設定すること。
+      void attachColdRegion(LogAllocator * region) { cold_region_ = region; }
+      LogAllocator * coldRegion() const { return cold_region_; }
+
+      // 圧縮された値の伸長に使う方式を設定する。(プロセス毎の設定なので、全てのプロセスで同じ方式を設定すること)
+      void attachCodec(const codec::Codec * codec) { codec_ = codec; }
+      const codec::Codec * codec() const { return codec_; }
+
+      // 同じ内容の値を共有するための表 (trie::DedupTable) の記述子を設定する。(0 なら共有しない)
+      void attachDedupTable(uint32_t md) { dedup_table_ = md; }
+      uint32_t dedupTable() const { return dedup_table_; }
+
       // allocateメソッドが返したメモリ記述子から、対応する実際にメモリ領域を取得する
       template<typename T>
       T* ptr(uint32_t md) const { return base_alc_.ptr<T>(md); }
@@ -172,7 +222,12 @@ namespace iht {
       T* ptr(uint32_t md, uint32_t offset) const { return base_alc_.ptr<T>(md, offset); }
 
     private:
+      // BLOCK_SIZE_LAST を越えるサイズ(VariableAllocatorから直接割り当てた領域)の場合は 0 を返す
       static uint32_t getSuperBlockId(uint32_t size) {
+        if(size > BLOCK_SIZE_LAST) {
+          return 0;
+        }
+        
         uint32_t block_size = BLOCK_SIZE_START;
         uint32_t id=1;
         for(; block_size < size; id++) {
@@ -186,6 +241,10 @@ namespace iht {
       SuperBlock* super_blocks_;
       VariableAllocator base_alc_;
       const uint32_t region_size_;
+      const atomic::Policy policy_;
+      LogAllocator * cold_region_;
+      const codec::Codec * codec_;
+      uint32_t dedup_table_;
     };
   }
 }
@@ -0,0 +1,87 @@
+#ifndef __IHT_ALLOCATOR_LOG_ALLOCATOR_HH__
+#define __IHT_ALLOCATOR_LOG_ALLOCATOR_HH__
+
+#include "../atomic/atomic.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <cassert>
+
+namespace iht {
+  namespace allocator {
+    static const char LOG_MAGIC[] = "IHT-LOG1";
+    
+    // 追記のみの(解放を行わない)アロケータ。
+    // 大きな値をメインの領域の外(ファイルに対応付けられた大きな領域)に置くためのもの。
+    // 領域の識別子は先頭からの64bitのオフセットなので、FixedAllocator の上限(256MB)を越える大きさの領域も扱える。
+    // 割り当てた領域は不変で、再利用されることはない。(領域を回収するには、テーブルを作り直す必要がある)
+    class LogAllocator {
+      struct Header {
+        char magic[sizeof(LOG_MAGIC)];
+        uint64_t size;
+        uint64_t tail; // 次に割り当てる位置
+      };
+
+      static const uint64_t ALIGN = 8;
+
+    public:
+      // threshold: この大きさ以上の値をこの領域に置く。(プロセス毎の設定で、領域には書き込まれない)
+      LogAllocator(void* region, uint64_t size, uint32_t threshold)
+        : h_(reinterpret_cast<Header*>(region)),
+          size_(size),
+          threshold_(threshold)
+      {
+      }
+
+      operator bool() const { return h_ != NULL && size_ > sizeof(Header); }
+
+      // 領域が未初期化(または大きさが異なる)の場合のみ初期化する
+      void initOnce() {
+        if(*this && (memcmp(h_->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 || h_->size != size_)) {
+          memcpy(h_->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+          h_->size = size_;
+          h_->tail = headerSize();
+        }
+      }
+
+      // size バイトの領域を割り当てて、そのオフセットを返す。(空きがない場合は 0)
+      uint64_t allocate(uint32_t size) {
+        const uint64_t aligned = (size + ALIGN - 1) & ~(ALIGN - 1);
+        for(;;) {
+          uint64_t tail = atomic::load(&h_->tail);
+          if(tail + aligned > size_) {
+            return 0;
+          }
+          if(atomic::compare_and_swap(&h_->tail, tail, tail + aligned)) {
+            return tail;
+          }
+        }
+      }
+
+      // size バイトの値をこの領域に置くべきかどうか (閾値以上で、かつ空きがある場合)
+      bool accepts(uint32_t size) const {
+        return size >= threshold_ && atomic::load(&h_->tail) + size + ALIGN <= size_;
+      }
+
+      // [offset, offset+size) が割り当て済みの範囲に収まっているかどうか
+      bool contains(uint64_t offset, uint32_t size) const {
+        const uint64_t tail = atomic::load(&h_->tail);
+        return offset >= headerSize() && size <= tail && offset <= tail - size;
+      }
+
+      template<typename T>
+      T* ptr(uint64_t offset) const { return reinterpret_cast<T*>(reinterpret_cast<char*>(h_) + offset); }
+
+      uint64_t used() const { return atomic::load(&h_->tail); }
+
+    private:
+      static uint64_t headerSize() { return (sizeof(Header) + ALIGN - 1) & ~(ALIGN - 1); }
+
+    private:
+      Header * h_;
+      const uint64_t size_;
+      const uint32_t threshold_;
+    };
+  }
+}
+
+#endif
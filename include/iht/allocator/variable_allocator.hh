@@ -72,10 +72,12 @@ namespace iht {
     public:
       // region: 割当に使用するメモリ領域。
       // size: regionのサイズ。メモリ領域の内の sizeof(Node)/sizeof(Chunk) は管理用に利用される。
-      VariableAllocator(void* region, uint32_t size)
+      // policy: SINGLE_THREAD なら管理情報の更新にロック命令を使わない。(region を一つのスレッドからしか使わない場合のみ)
+      VariableAllocator(void* region, uint32_t size, atomic::Policy policy=atomic::MULTI_THREAD)
         : node_count_(size/(sizeof(Node)+sizeof(Chunk))),
           nodes_(reinterpret_cast<Node*>(region)),
-          chunks_(reinterpret_cast<Chunk*>(nodes_+node_count_)) {
+          chunks_(reinterpret_cast<Chunk*>(nodes_+node_count_)),
+          policy_(policy) {
       }
       
       operator bool() const { return nodes_ != NULL && node_count_ > 2 && node_count_ < NODE_COUNT_LIMIT; }
@@ -109,7 +111,7 @@ namespace iht {
 
         uint32_t need_chunk_count = (size+sizeof(Chunk)-1) / sizeof(Chunk);
       
-        NodeSnapshot cand;
+        NodeSnapshot cand(policy_);
         if(findCandidate(IsEnoughChunk(need_chunk_count), cand) == false) {
           return 0; // out of memory (or exceeded retry limit)
         }
@@ -129,6 +131,13 @@ namespace iht {
         return desc.encode();
       }
 
+      // size バイトの連続した空き領域があるかどうかを返す。(実際には割り当てない)
+      // allocate() と同様に、極めて高い競合下では空きがあっても false を返すことがある。
+      bool hasRoom(uint32_t size) {
+        NodeSnapshot cand(policy_);
+        return findCandidate(IsEnoughChunk((size+sizeof(Chunk)-1) / sizeof(Chunk)), cand);
+      }
+
       // allocateメソッドで割り当てたメモリ領域を解放する。(解放に成功した場合は trueを、失敗した場合は false を返す)
       // md(メモリ記述子)が 0 の場合は何も行わない。
       //
@@ -161,7 +170,7 @@ namespace iht {
         Descriptor desc = Descriptor::decode(md);
 
         for(;;) {
-          NodeSnapshot snap(nodes_ + desc.index);
+          NodeSnapshot snap = NodeSnapshot::loaded(nodes_ + desc.index, policy_);
           Node node = snap.node();
           if(node.version != desc.version || node.refCount() == 0) {
             // 既に解放済み
@@ -182,7 +191,7 @@ namespace iht {
 
         Descriptor desc = Descriptor::decode(md);
 
-        NodeSnapshot snap(nodes_ + desc.index);
+        NodeSnapshot snap(nodes_ + desc.index, policy_);
         Node node = snap.node();
         assert(node.version == desc.version);
         assert(node.refCount() == 0);
@@ -204,7 +213,7 @@ namespace iht {
         Descriptor desc = Descriptor::decode(md);
         
         for(;;) {
-          NodeSnapshot snap(nodes_ + desc.index);
+          NodeSnapshot snap = NodeSnapshot::loaded(nodes_ + desc.index, policy_);
           Node node = snap.node();
           assert(node.version == desc.version);
           
@@ -249,7 +258,7 @@ namespace iht {
       
       template<class Callback>
       bool findCandidate(const Callback& fn, NodeSnapshot& node, int retry=RETRY_LIMIT) {
-        NodeSnapshot head(&nodes_[0]);
+        NodeSnapshot head(&nodes_[0], policy_);
         return findCandidate(fn, head, node, retry);
       }
 
@@ -328,7 +337,6 @@ namespace iht {
       }
 
       bool releaseImpl(uint32_t md, int retry_limit, bool fast) {
-        std::cerr << "# [var] release: " << md << std::endl;
         if(md == 0) {
           return true;
         }
@@ -336,7 +344,7 @@ namespace iht {
         Descriptor desc = Descriptor::decode(md);
 
         uint32_t node_index = desc.index;
-        NodeSnapshot pred;
+        NodeSnapshot pred(policy_);
         if(findCandidate(IsPredecessor(node_index), pred, retry_limit) == false) {
           return false;
         }
@@ -376,6 +384,7 @@ namespace iht {
       const uint32_t node_count_;
       Node* nodes_;
       Chunk* chunks_;      
+      const atomic::Policy policy_;
     };
   }
 }
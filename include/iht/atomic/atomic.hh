@@ -81,28 +81,117 @@ namespace iht {
       return fetch_and_add(place, 0);
     }
 
+    // 読み込みのみを行う。(fetch と異なり、キャッシュラインへの書き込み(排他取得)を伴わない)
+    // NOTE: x86 では通常の読み込みが acquire の順序付けを持つので、ここではコンパイラによる並べ替えのみを抑止する
+    template<typename T>
+    T load(T* place) {
+      T v = *const_cast<volatile T*>(place);
+      __asm__ __volatile__("" ::: "memory");
+      return v;
+    }
+
+    // 構造体などの値を、同じサイズの整数として一度に読み込む load()
+    template<typename T>
+    T load_word(T* place) {
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      return union_conv<uint, T>(load(union_conv<T, uint>(place)));
+    }
+
+    // 書き込みのみを行う。(x86 では通常の書き込みが release の順序付けを持つ)
+    template<typename T, typename T2>
+    void store(T* place, T2 value) {
+      __asm__ __volatile__("" ::: "memory");
+      *const_cast<volatile T*>(place) = value;
+    }
+
+    // 前後の読み書きの順序を保証する。(x86 で store -> load の並べ替えを防ぐのに必要)
+    inline void fence() {
+      __sync_synchronize();
+    }
+
+    // 並行性の方針。
+    // SINGLE_THREAD は(一つのプロセスの)一つのスレッドからしか使われないことを利用者が保証する場合のためのもので、
+    // 以下の方針付きの各操作をロック命令を使わない通常の読み書きで行う。
+    enum Policy {
+      MULTI_THREAD,
+      SINGLE_THREAD
+    };
+
+    template<typename T, typename T2>
+    bool compare_and_swap(Policy policy, T* place, T2 old_value, T2 new_value) {
+      if(policy == MULTI_THREAD) {
+        return compare_and_swap(place, old_value, new_value);
+      }
+      
+      typedef typename SizeToType<sizeof(T)>::TYPE uint;
+      uint* p = union_conv<T, uint>(place);
+      if(*p != union_conv<T2, uint>(old_value)) {
+        return false;
+      }
+      *p = union_conv<T2, uint>(new_value);
+      return true;
+    }
+
+    template<typename T>
+    void add(Policy policy, T* place, int delta) {
+      if(policy == MULTI_THREAD) {
+        add(place, delta);
+      } else {
+        *place += delta;
+      }
+    }
+
+    template<typename T>
+    void sub(Policy policy, T* place, int delta) {
+      if(policy == MULTI_THREAD) {
+        sub(place, delta);
+      } else {
+        *place -= delta;
+      }
+    }
+
+    template<typename T>
+    T fetch(Policy policy, T* place) {
+      return policy == MULTI_THREAD ? fetch(place) : *place;
+    }
+
+    inline void fence(Policy policy) {
+      if(policy == MULTI_THREAD) {
+        fence();
+      }
+    }
+
     // スナップショットクラス
     template<typename T>
     class Snapshot {
     public:
-      Snapshot() : ptr_(NULL) {}
-      Snapshot(T* ptr) : ptr_(ptr), val_(atomic::fetch(ptr)) {}
+      Snapshot(Policy policy=MULTI_THREAD) : ptr_(NULL), policy_(policy) {}
+      Snapshot(T* ptr, Policy policy=MULTI_THREAD) : ptr_(ptr), val_(atomic::fetch(policy, ptr)), policy_(policy) {}
       
       void update(T* ptr) {
         ptr_ = ptr;
-        val_ = atomic::fetch(ptr);
+        val_ = atomic::fetch(policy_, ptr);
       }
       
+      // 読み込みのみで値を取得したスナップショットを返す。(ロック命令を使わないので、参照カウントの増減のように
+      // 取得した値が古くても compare_and_swap() が失敗して取り直すだけで済む場合に使う)
+      static Snapshot loaded(T* ptr, Policy policy=MULTI_THREAD) {
+        Snapshot snap(policy);
+        snap.ptr_ = ptr;
+        snap.val_ = load_word(ptr);
+        return snap;
+      }
+
       const T& node() const { return val_; }
       const T* place() const { return ptr_; }
 
       bool isModified() const { 
-        T tmp_val = atomic::fetch(ptr_);
+        T tmp_val = atomic::fetch(policy_, ptr_);
         return memcmp(&tmp_val, &val_, sizeof(T)) != 0;
       }
       
       bool compare_and_swap(const T& new_val) {
-        if(atomic::compare_and_swap(ptr_, val_, new_val)) {
+        if(atomic::compare_and_swap(policy_, ptr_, val_, new_val)) {
           val_ = new_val;
           return true;
         }
@@ -112,6 +201,7 @@ namespace iht {
       protected:
         T* ptr_;
         T  val_;
+        Policy policy_;
     };
   }
 }
@@ -0,0 +1,28 @@
+#ifndef __IHT_CODEC_CODEC_HH__
+#define __IHT_CODEC_CODEC_HH__
+
+#include "../string.hh"
+#include <string>
+
+namespace iht {
+  namespace codec {
+    // 値の圧縮方式。HashTrie::setValueCodec() で設定する。
+    // 圧縮された値は検索で読み出される時に初めて伸長される。
+    class Codec {
+    public:
+      virtual ~Codec() {}
+
+      // src を圧縮したものを dst に格納する。圧縮しても小さくならない場合は false を返す。(その場合は圧縮せずに格納される)
+      virtual bool compress(const String & src, std::string & dst) const = 0;
+
+      // compress() で圧縮されたデータ src を伸長したものを dst に格納する。(データが壊れている場合は false)
+      virtual bool decompress(const String & src, std::string & dst) const = 0;
+
+      // 方式(と伸長に影響するパラメータ)を識別する 0 以外の値。
+      // 最初に設定された方式の値がテーブルに記録され、異なる方式を設定しようとした場合の検出に使われる。
+      virtual uint32_t id() const = 0;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef __IHT_CODEC_LZ_HH__
+#define __IHT_CODEC_LZ_HH__
+
+#include "codec.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+
+namespace iht {
+  namespace codec {
+    // LZ77系の高速な圧縮方式。(形式は LZ4 のブロック形式に近いが互換性はない)
+    //
+    // 形式: [元のサイズ(32bit)] [シーケンス]*
+    //  シーケンス = [トークン(上位4bit:リテラル長, 下位4bit:一致長-MIN_MATCH)] [リテラル長の続き]* [リテラル]
+    //              [オフセット(16bit)] [一致長の続き]*
+    //  長さが 15 の場合は続くバイトを加算する(255 の間は更に続く)。最後のシーケンスはリテラルのみで終わる。
+    //
+    // 4バイト毎のハッシュ表で直近の出現位置のみを探すので、圧縮率より速度を優先している。
+    // 繰り返しの多い JSON や protobuf などの値を想定している。
+    //
+    // 一つ一つの値が小さい場合は値の中での繰り返しが少ないので、値に共通する部分(典型的な値など)を辞書として渡すとよい。
+    // 辞書は各値の直前に置かれているものとして扱われ、一致の参照先にできる。(末尾の MAX_OFFSET バイト未満のみを使う)
+    // NOTE: 伸長には圧縮時と同じ辞書が必要
+    class LZ : public Codec {
+      static const uint32_t MIN_MATCH = 4;
+      static const uint32_t MAX_OFFSET = 0xFFFF;
+      static const uint32_t HASH_BITS = 12;
+      static const uint32_t NIL = 0xFFFFFFFF;
+      static const uint32_t ID_TAG = 0x4C5A0001; // "LZ"
+
+    public:
+      LZ(const String & dictionary=String()) {
+        const uint32_t limit = MAX_OFFSET - 1;
+        if(dictionary.size() > limit) {
+          dict_.assign(dictionary.data() + dictionary.size() - limit, limit);
+        } else {
+          dict_.assign(dictionary.data(), dictionary.size());
+        }
+
+        // 辞書内の各位置を予め登録したハッシュ表 (圧縮の度にこれを複製して使う)
+        memset(dict_table_, 0xFF, sizeof(dict_table_));
+        const unsigned char * d = reinterpret_cast<const unsigned char*>(dict_.data());
+        for(uint32_t pos = 0; pos + MIN_MATCH <= dict_.size(); pos++) {
+          dict_table_[hashAt(d + pos)] = pos;
+        }
+
+        // 辞書が異なると伸長できないので、識別子には辞書のハッシュ値を含める
+        id_ = ID_TAG ^ String(dict_).hash();
+        if(id_ == 0) {
+          id_ = ID_TAG;
+        }
+      }
+
+      virtual uint32_t id() const { return id_; }
+
+      virtual bool compress(const String & src, std::string & dst) const {
+        const uint32_t size = src.size();
+
+        // 辞書と値を連結したものを、辞書の後ろから圧縮する
+        std::string joined;
+        const unsigned char * in = reinterpret_cast<const unsigned char*>(src.data());
+        if(! dict_.empty()) {
+          joined.reserve(dict_.size() + size);
+          joined.append(dict_).append(src.data(), size);
+          in = reinterpret_cast<const unsigned char*>(joined.data());
+        }
+        const uint32_t base = dict_.size();
+        const uint32_t end = base + size;
+
+        dst.clear();
+        dst.reserve(size);
+        putU32(dst, size);
+
+        uint32_t table[1 << HASH_BITS];
+        memcpy(table, dict_table_, sizeof(table));
+
+        uint32_t anchor = base; // 未出力のリテラルの先頭
+        uint32_t pos = base;
+        while(pos + MIN_MATCH <= end) {
+          uint32_t h = hashAt(in + pos);
+          uint32_t cand = table[h];
+          table[h] = pos;
+          
+          if(cand == NIL || pos - cand > MAX_OFFSET || memcmp(in + cand, in + pos, MIN_MATCH) != 0) {
+            pos++;
+            continue;
+          }
+
+          uint32_t len = MIN_MATCH;
+          while(pos + len < end && in[cand + len] == in[pos + len]) {
+            len++;
+          }
+          
+          putSequence(dst, in + anchor, pos - anchor, pos - cand, len);
+          pos += len;
+          anchor = pos;
+          if(dst.size() >= size) {
+            return false;
+          }
+        }
+
+        putLiterals(dst, in + anchor, end - anchor);
+        return dst.size() < size;
+      }
+
+      virtual bool decompress(const String & src, std::string & dst) const {
+        const unsigned char * in = reinterpret_cast<const unsigned char*>(src.data());
+        const unsigned char * end = in + src.size();
+        if(src.size() < sizeof(uint32_t)) {
+          return false;
+        }
+        
+        uint32_t size;
+        memcpy(&size, in, sizeof(uint32_t));
+        in += sizeof(uint32_t);
+
+        dst.resize(size);
+        char * out = size == 0 ? NULL : &dst[0];
+        uint32_t pos = 0;
+        while(in < end) {
+          const uint32_t token = *in++;
+          
+          uint32_t lit_len = token >> 4;
+          if(! getLength(in, end, lit_len) || lit_len > static_cast<uint32_t>(end - in) || lit_len > size - pos) {
+            return false;
+          }
+          memcpy(out + pos, in, lit_len);
+          in += lit_len;
+          pos += lit_len;
+          
+          if(in == end) {
+            break; // 最後のシーケンス
+          }
+
+          if(end - in < 2) {
+            return false;
+          }
+          uint32_t offset = in[0] | (in[1] << 8);
+          in += 2;
+          
+          uint32_t len = token & 0xF;
+          if(! getLength(in, end, len)) {
+            return false;
+          }
+          len += MIN_MATCH;
+          if(offset == 0 || offset > pos + dict_.size() || len > size - pos) {
+            return false;
+          }
+          
+          // 一致範囲の先頭が辞書内にある場合は、その部分を辞書からコピーする
+          if(offset > pos) {
+            const uint32_t from = dict_.size() - (offset - pos);
+            const uint32_t n = std::min(len, offset - pos);
+            memcpy(out + pos, dict_.data() + from, n);
+            pos += n;
+            len -= n;
+          }
+          
+          // 一致範囲は出力位置と重なりうるので、1バイトずつコピーする
+          for(const char * from = out + pos - offset; len > 0; len--) {
+            out[pos++] = *from++;
+          }
+        }
+        return pos == size;
+      }
+
+    private:
+      static uint32_t hashAt(const unsigned char * p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(uint32_t));
+        return (v * 2654435761U) >> (32 - HASH_BITS);
+      }
+
+      static void putU32(std::string & dst, uint32_t v) {
+        dst.append(reinterpret_cast<const char*>(&v), sizeof(uint32_t));
+      }
+      
+      // 15 を越える長さの残りを出力する
+      static void putLength(std::string & dst, uint32_t len) {
+        for(; len >= 255; len -= 255) {
+          dst += static_cast<char>(255);
+        }
+        dst += static_cast<char>(len);
+      }
+      
+      static bool getLength(const unsigned char *& in, const unsigned char * end, uint32_t & len) {
+        if(len != 15) {
+          return true;
+        }
+        for(;;) {
+          if(in == end) {
+            return false;
+          }
+          uint32_t b = *in++;
+          len += b;
+          if(b != 255) {
+            return true;
+          }
+        }
+      }
+
+      static void putSequence(std::string & dst, const unsigned char * lit, uint32_t lit_len, uint32_t offset, uint32_t len) {
+        const uint32_t match_len = len - MIN_MATCH;
+        dst += static_cast<char>(((lit_len < 15 ? lit_len : 15) << 4) | (match_len < 15 ? match_len : 15));
+        if(lit_len >= 15) {
+          putLength(dst, lit_len - 15);
+        }
+        dst.append(reinterpret_cast<const char*>(lit), lit_len);
+        dst += static_cast<char>(offset & 0xFF);
+        dst += static_cast<char>(offset >> 8);
+        if(match_len >= 15) {
+          putLength(dst, match_len - 15);
+        }
+      }
+
+      static void putLiterals(std::string & dst, const unsigned char * lit, uint32_t lit_len) {
+        dst += static_cast<char>((lit_len < 15 ? lit_len : 15) << 4);
+        if(lit_len >= 15) {
+          putLength(dst, lit_len - 15);
+        }
+        dst.append(reinterpret_cast<const char*>(lit), lit_len);
+      }
+
+    private:
+      std::string dict_;
+      uint32_t dict_table_[1 << HASH_BITS];
+      uint32_t id_;
+    };
+  }
+}
+
+#endif
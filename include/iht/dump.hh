@@ -0,0 +1,198 @@
+#ifndef __IHT_DUMP_HH__
+#define __IHT_DUMP_HH__
+
+#include "string.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+namespace iht {
+  static const char DUMP_MAGIC[] = "IHT-DUMP";
+  static const uint32_t DUMP_VERSION = 1;
+
+  // View::dump() で書き出し、HashTrie::restore() で読み込むテーブルの書き出し形式。(ホストや共有メモリのサイズに依存しない)
+  //
+  // 形式: [Header] [Record]* [終端(key_size が END の Record ヘッダ)] [エントリ数(64bit)]
+  //  Record = [hash(32bit)] [key_size(32bit)] [val_size(32bit)] [expires_at(32bit)] [キー] [値]
+  //  値は圧縮や Blob への分割を解いたもの。expires_at は有効期限 (0 なら期限なし)
+  //
+  // レコードは「ハッシュ値の下位の4ビットから順に並べた順序」(RootNode::trieOrder()) で並んでいる。
+  // 読み込み側はこの順序を使って、キー毎の挿入ではなく一度の走査でトライを組み立てる。
+  // 書き込み・読み込みは大きなバッファ単位で行うので、ファイルの他にパイプやソケットも使える。
+  namespace dump {
+    struct Header {
+      char magic[sizeof(DUMP_MAGIC)];
+      uint32_t version;
+      uint64_t count_hint; // エントリ数の見込み (期限切れのエントリを含む。組み立て時の段数の見積もりに使う)
+    };
+
+    struct RecordHeader {
+      uint32_t hash;
+      uint32_t key_size;
+      uint32_t val_size;
+      uint32_t expires_at;
+    };
+
+    static const uint32_t END = 0xFFFFFFFF;
+    static const size_t BUFFER_SIZE = 1024 * 1024;
+
+    class Writer {
+    public:
+      Writer(int fd, uint64_t count_hint)
+        : fd_(fd),
+          count_(0),
+          ok_(fd != -1)
+      {
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, DUMP_MAGIC, sizeof(DUMP_MAGIC));
+        h.version = DUMP_VERSION;
+        h.count_hint = count_hint;
+        append(&h, sizeof(h));
+      }
+
+      operator bool() const { return ok_; }
+
+      void add(const String & key, const String & value, uint32_t hash, uint32_t expires_at) {
+        RecordHeader r = {hash, key.size(), value.size(), expires_at};
+        append(&r, sizeof(r));
+        append(key.data(), key.size());
+        append(value.data(), value.size());
+        count_++;
+      }
+
+      // 終端とエントリ数を書き込む。成功した場合は true を返す。
+      bool finish() {
+        RecordHeader r = {0, END, 0, 0};
+        append(&r, sizeof(r));
+        append(&count_, sizeof(count_));
+        flush();
+        return ok_;
+      }
+
+    private:
+      void append(const void * data, size_t size) {
+        buf_.append(reinterpret_cast<const char*>(data), size);
+        if(buf_.size() >= BUFFER_SIZE) {
+          flush();
+        }
+      }
+
+      void flush() {
+        const char * p = buf_.data();
+        for(size_t rest = buf_.size(); ok_ && rest > 0;) {
+          ssize_t n = write(fd_, p, rest);
+          if(n <= 0) {
+            ok_ = false;
+            break;
+          }
+          p += n;
+          rest -= n;
+        }
+        buf_.clear();
+      }
+
+    private:
+      const int fd_;
+      uint64_t count_;
+      std::string buf_;
+      bool ok_;
+    };
+
+    class Reader {
+    public:
+      Reader(int fd)
+        : fd_(fd),
+          pos_(0),
+          count_(0),
+          ok_(fd != -1),
+          end_(false)
+      {
+        memset(&h_, 0, sizeof(h_));
+        ok_ = ok_ && read(&h_, sizeof(h_)) &&
+              memcmp(h_.magic, DUMP_MAGIC, sizeof(DUMP_MAGIC)) == 0 && h_.version == DUMP_VERSION;
+      }
+
+      // ヘッダが正しく読めたかどうか (読み込み中にエラーがあった場合も false になる)
+      operator bool() const { return ok_; }
+
+      uint64_t countHint() const { return h_.count_hint; }
+
+      // 次のレコードを読み込む。終端に達した場合やエラーの場合は false を返す。
+      // key と value は次に next() を呼び出すまで有効。
+      bool next(String & key, String & value, uint32_t & hash, uint32_t & expires_at) {
+        RecordHeader r;
+        if(! ok_ || end_ || ! read(&r, sizeof(r))) {
+          return false;
+        }
+
+        if(r.key_size == END) {
+          // 終端の後のエントリ数が読んだレコード数と一致しなければ、途中のレコードが欠けているか壊れている
+          uint64_t count;
+          if(! read(&count, sizeof(count))) {
+            return false;
+          }
+          if(count != count_) {
+            ok_ = false;
+            return false;
+          }
+          end_ = true;
+          return false;
+        }
+
+        record_.resize(static_cast<size_t>(r.key_size) + r.val_size);
+        if(! read(record_.empty() ? NULL : &record_[0], record_.size())) {
+          return false;
+        }
+        key = String(record_.data(), r.key_size);
+        value = String(record_.data() + r.key_size, r.val_size);
+        hash = r.hash;
+        expires_at = r.expires_at;
+        count_++;
+        return true;
+      }
+
+      // 終端まで正しく読み込めたかどうか (終端のエントリ数が読んだレコード数と一致した場合のみ true)
+      bool completed() const { return ok_ && end_; }
+
+    private:
+      bool read(void * dst, size_t size) {
+        char * p = reinterpret_cast<char*>(dst);
+        while(size > 0) {
+          if(pos_ == buf_.size()) {
+            buf_.resize(BUFFER_SIZE);
+            ssize_t n = ::read(fd_, &buf_[0], buf_.size());
+            if(n <= 0) {
+              buf_.clear();
+              pos_ = 0;
+              ok_ = false;
+              return false;
+            }
+            buf_.resize(n);
+            pos_ = 0;
+          }
+
+          size_t n = buf_.size() - pos_ < size ? buf_.size() - pos_ : size;
+          memcpy(p, buf_.data() + pos_, n);
+          pos_ += n;
+          p += n;
+          size -= n;
+        }
+        return true;
+      }
+
+    private:
+      const int fd_;
+      Header h_;
+      std::string buf_;
+      size_t pos_;
+      std::string record_;
+      uint64_t count_;
+      bool ok_;
+      bool end_;
+    };
+  }
+}
+
+#endif
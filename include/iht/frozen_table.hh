@@ -0,0 +1,273 @@
+#ifndef __IHT_FROZEN_TABLE_HH__
+#define __IHT_FROZEN_TABLE_HH__
+
+#include "string.hh"
+#include "ipc/mapped_file.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace iht {
+  static const char FROZEN_MAGIC[] = "IHT-FROZEN-0.1";
+
+  // View::freeze() で書き出した、更新できない読み込み専用のテーブル。
+  // 参照カウントやリスト、ノードを持たず、ハッシュ値で引く開番地法の表と、キーと値を詰めて並べたレコード群のみからなる。
+  // 一回の検索で触れるのは、基本的に表のスロット(16バイト)とレコードの二箇所のみ。
+  //
+  // ファイル形式: [Header] [Slot * slot_count] [Record]*
+  //  Record = [値のサイズ(32bit)] [キー] [値]  (キーのサイズはスロットが持つ)
+  // NOTE: ハッシュ値は元のテーブルのエントリのものをそのまま使うので、String::hash() 以外で格納したテーブルは find(key, hash) で引くこと
+  class FrozenTable {
+    struct Header {
+      char magic[sizeof(FROZEN_MAGIC)];
+      uint32_t count;
+      uint32_t slot_count; // 2の冪
+    };
+
+    struct Slot {
+      uint32_t hash;
+      uint32_t key_size;
+      uint64_t offset; // ファイル先頭からのレコードの位置 (空きスロットは 0)
+    };
+
+  public:
+    // ファイルの形式が正しくない(表やレコードがファイルに収まっていない場合を含む)場合は、operator bool() が false を返す
+    FrozenTable(const std::string & filepath)
+      : file_(filepath),
+        h_(NULL),
+        slots_(NULL)
+    {
+      if(file_ && file_.size() >= sizeof(Header) &&
+         memcmp(file_.ptr<Header>()->magic, FROZEN_MAGIC, sizeof(FROZEN_MAGIC)) == 0) {
+        const Header * h = file_.ptr<Header>();
+        const Slot * slots = file_.ptr<Slot>(sizeof(Header));
+        if(isValid(h, slots)) {
+          h_ = h;
+          slots_ = slots;
+        }
+      }
+    }
+
+    operator bool() const { return h_ != NULL; }
+
+    size_t size() const { return h_->count; }
+
+    // key に対応する値を返す。(存在しない場合は String::invalid())
+    // 値はファイルを対応付けた領域を直接参照するので、FrozenTable が存在する間は有効。
+    String find(const String & key) const {
+      return find(key, key.hash());
+    }
+
+    // NOTE: レコードがファイルに収まっているかは、開いた時に加えて検索の度にも確かめる
+    String find(const String & key, uint32_t hash) const {
+      const uint32_t mask = h_->slot_count - 1;
+      uint32_t i = hash & mask;
+      for(uint32_t n=0; n < h_->slot_count; n++, i = (i + 1) & mask) {
+        const Slot & slot = slots_[i];
+        if(slot.offset == 0) {
+          break;
+        }
+        if(slot.hash == hash && slot.key_size == key.size()) {
+          const char * record = recordOf(slot, h_->slot_count);
+          if(record != NULL && memcmp(record + sizeof(uint32_t), key.data(), key.size()) == 0) {
+            return String(record + sizeof(uint32_t) + key.size(), valueSize(record));
+          }
+        }
+      }
+      return String::invalid();
+    }
+
+    bool isMember(const String & key) const {
+      return find(key).data() != String::invalid().data();
+    }
+
+    // 全てのエントリを callback(key, value) に渡す。(順序は表のスロット順。ファイルに収まっていないレコードは飛ばす)
+    template <class Callback>
+    void foreach(Callback & callback) const {
+      for(uint32_t i=0; i < h_->slot_count; i++) {
+        const Slot & slot = slots_[i];
+        const char * record = slot.offset != 0 ? recordOf(slot, h_->slot_count) : NULL;
+        if(record != NULL) {
+          callback(String(record + sizeof(uint32_t), slot.key_size),
+                   String(record + sizeof(uint32_t) + slot.key_size, valueSize(record)));
+        }
+      }
+    }
+
+    // FrozenTable のファイルを書き出す。
+    // レコードは add() の度にファイルに追記し、表はメモリ上で組み立てて commit() で先頭に書き込む。
+    // 書き込み中は一時ファイル(filepath + ".tmp")に書き、commit() で filepath に置き換えるので、
+    // 既存のファイルを使っている読み込み側が書きかけの内容を見ることはない。
+    class Builder {
+    public:
+      // capacity は追加するエントリ数の上限 (表の大きさはその二倍以上の2の冪になる)
+      Builder(const std::string & filepath, uint32_t capacity, mode_t mode=0660)
+        : filepath_(filepath),
+          tmppath_(filepath + ".tmp"),
+          fd_(open(tmppath_.c_str(), O_CREAT|O_TRUNC|O_WRONLY, mode)),
+          slots_(slotCountFor(capacity)),
+          count_(0),
+          offset_(sizeof(Header) + sizeof(Slot) * slots_.size()),
+          ok_(fd_ != -1)
+      {
+        memset(&slots_[0], 0, sizeof(Slot) * slots_.size());
+      }
+
+      ~Builder() {
+        if(fd_ != -1) {
+          close(fd_);
+          unlink(tmppath_.c_str()); // commit() されなかった
+        }
+      }
+
+      operator bool() const { return ok_; }
+
+      // NOTE: 同じキーを複数回追加してはいけない
+      void add(const String & key, const String & value, uint32_t hash) {
+        if(! ok_ || count_ * 2 >= slots_.size()) {
+          ok_ = false;
+          return;
+        }
+
+        const uint32_t mask = slots_.size() - 1;
+        uint32_t i = hash & mask;
+        for(; slots_[i].offset != 0; i = (i + 1) & mask);
+        slots_[i].hash = hash;
+        slots_[i].key_size = key.size();
+        slots_[i].offset = offset_;
+        count_++;
+
+        const uint32_t val_size = value.size();
+        buf_.append(reinterpret_cast<const char*>(&val_size), sizeof(uint32_t));
+        buf_.append(key.data(), key.size());
+        buf_.append(value.data(), value.size());
+        offset_ += sizeof(uint32_t) + key.size() + value.size();
+        if(buf_.size() >= FLUSH_SIZE) {
+          flush();
+        }
+      }
+
+      // 表を書き込んで、ファイルを filepath に置き換える。成功した場合は true を返す。
+      bool commit() {
+        flush();
+
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, FROZEN_MAGIC, sizeof(FROZEN_MAGIC));
+        h.count = count_;
+        h.slot_count = slots_.size();
+        ok_ = ok_ &&
+              pwriteAll(&h, sizeof(h), 0) &&
+              pwriteAll(&slots_[0], sizeof(Slot) * slots_.size(), sizeof(Header)) &&
+              fsync(fd_) == 0;
+
+        close(fd_);
+        fd_ = -1;
+        if(! ok_ || rename(tmppath_.c_str(), filepath_.c_str()) != 0) {
+          unlink(tmppath_.c_str());
+          return false;
+        }
+        return true;
+      }
+
+    private:
+      static const size_t FLUSH_SIZE = 1024 * 1024;
+
+      static size_t slotCountFor(uint32_t capacity) {
+        size_t n = 16;
+        while(n < static_cast<size_t>(capacity) * 2 + 1) {
+          n *= 2;
+        }
+        return n;
+      }
+
+      void flush() {
+        if(ok_ && ! buf_.empty()) {
+          ok_ = pwriteAll(buf_.data(), buf_.size(), offset_ - buf_.size());
+        }
+        buf_.clear();
+      }
+
+      bool pwriteAll(const void * data, size_t size, off_t offset) {
+        const char * p = reinterpret_cast<const char*>(data);
+        while(size > 0) {
+          ssize_t n = pwrite(fd_, p, size, offset);
+          if(n <= 0) {
+            return false;
+          }
+          p += n;
+          size -= n;
+          offset += n;
+        }
+        return true;
+      }
+
+    private:
+      const std::string filepath_;
+      const std::string tmppath_;
+      int fd_;
+      std::vector<Slot> slots_;
+      uint32_t count_;
+      uint64_t offset_; // 次のレコードを書き込む位置
+      std::string buf_; // まだ書き込んでいないレコード
+      bool ok_;
+    };
+
+  private:
+    static uint32_t valueSize(const char * record) {
+      uint32_t size;
+      memcpy(&size, record, sizeof(uint32_t));
+      return size;
+    }
+
+    // 表(slot_count 個のスロット)に続くレコード群の先頭位置
+    static uint64_t recordsOffset(uint32_t slot_count) {
+      return sizeof(Header) + static_cast<uint64_t>(sizeof(Slot)) * slot_count;
+    }
+
+    // slot が指すレコードが(キーと値を含めて)ファイルに収まっていればその先頭を、そうでなければ NULL を返す
+    const char * recordOf(const Slot & slot, uint32_t slot_count) const {
+      const uint64_t size = file_.size();
+      if(slot.offset < recordsOffset(slot_count) || slot.offset > size ||
+         size - slot.offset < sizeof(uint32_t) + static_cast<uint64_t>(slot.key_size)) {
+        return NULL;
+      }
+      const char * record = file_.ptr<char>(slot.offset);
+      if(size - slot.offset - sizeof(uint32_t) - slot.key_size < valueSize(record)) {
+        return NULL;
+      }
+      return record;
+    }
+
+    // 表の大きさが2の冪でファイルに収まり、各レコードもファイルに収まっていて、エントリ数が表と一致するかどうか。
+    // (空きスロットがあることも確かめるので、検索が空きスロットに行き当たらずに表を一周することはない)
+    bool isValid(const Header * h, const Slot * slots) const {
+      const uint32_t slot_count = h->slot_count;
+      if(slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || recordsOffset(slot_count) > file_.size()) {
+        return false;
+      }
+      uint32_t count = 0;
+      for(uint32_t i=0; i < slot_count; i++) {
+        if(slots[i].offset != 0) {
+          if(recordOf(slots[i], slot_count) == NULL) {
+            return false;
+          }
+          count++;
+        }
+      }
+      return count == h->count && count < slot_count;
+    }
+
+  private:
+    ipc::MappedFile file_;
+    const Header * h_;
+    const Slot * slots_;
+  };
+}
+
+#endif
@@ -2,30 +2,52 @@
 #define __IHT_HASHTRIE_HH__
 
 #include "string.hh"
+#include "sketch.hh"
 #include "ipc/shared_memory.hh"
 #include "trie/hashtrie_impl.hh"
+#include "codec/lz.hh"
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <sys/types.h>
+#include <pthread.h>
+#include <assert.h>
 
 namespace iht {
+  class Draft;
+  
   class HashTrie {
   public:
-    HashTrie(size_t shm_size)
+    // policy に atomic::SINGLE_THREAD を指定すると、ロック命令を使わない(一つのスレッドからのみ使える)プロセス内のマップになる
+    HashTrie(size_t shm_size, const trie::ResizePolicy & resize_policy=trie::ResizePolicy(),
+             atomic::Policy policy=atomic::MULTI_THREAD)
       : shm_(shm_size),
-        impl_(shm_)
+        impl_(shm_, resize_policy, policy),
+        value_shm_(NULL),
+        value_alc_(NULL)
     {
       init();
     }
 
-    HashTrie(size_t shm_size, const std::string & filepath, mode_t mode=0660)
+    // NOTE: resize_policy は共有メモリを新たに初期化する場合にのみ使われる
+    HashTrie(size_t shm_size, const std::string & filepath, mode_t mode=0660,
+             const trie::ResizePolicy & resize_policy=trie::ResizePolicy(),
+             atomic::Policy policy=atomic::MULTI_THREAD)
       : shm_(filepath, shm_size, mode),
-        impl_(shm_)
+        impl_(shm_, resize_policy, policy),
+        value_shm_(NULL),
+        value_alc_(NULL)
     {
       if(*this) {
         impl_.initOnce();
       }
     }
 
+    ~HashTrie() {
+      delete value_alc_;
+      delete value_shm_;
+    }
+
     operator bool() const { return shm_ && impl_; }
 
     void init() {
@@ -34,9 +56,105 @@ namespace iht {
       }
     }
 
-    void store(const String & key, const String & value) {
+    // 共有メモリ領域に空きがなく追加できない場合は false を返す。(テーブルは変更されない。ただし容量制限による追い出しは行われる)
+    bool store(const String & key, const String & value) {
       // TODO: acquire lock
-      impl_.store(key, value);
+      return impl_.store(key, value);
+    }
+
+    // hash は key のハッシュ値。String::hash() 以外のハッシュ関数を使う場合は、テーブルの全てのキーでそれを使うこと。
+    // (検索時も View::find(key, hash) で同じハッシュ値を渡す必要がある)
+    bool store(const String & key, const String & value, uint32_t hash) {
+      return impl_.store(key, value, hash);
+    }
+
+    // ttl 秒後に期限切れとなるエントリを追加する。
+    // 期限切れのエントリは検索や stats()、foreach() で見えなくなり、そのリストが次に書き換えられる時か sweep() でリストから取り除かれる。
+    // NOTE: size() は取り除かれるまでの期限切れのエントリも含む
+    bool storeWithTTL(const String & key, const String & value, uint32_t ttl) {
+      return impl_.store(key, value, key.hash(), trie::Entry::now() + ttl);
+    }
+
+    // 期限切れのエントリを、前回の続きから最大 max_buckets 個のリストについて取り除く。取り除いたエントリの数を返す。
+    // 一回あたりの処理量が限られるので、定期的に(e.g. 保守用のスレッドから)繰り返し呼び出すことを想定している。
+    // 取り除いたエントリの領域は、それを含む古いrootを参照する読み込み側(View)がいなくなった時点で回収される。
+    // NOTE: store() と同様に書き込み操作なので、他の書き込みとは直列化すること
+    size_t sweep(uint32_t max_buckets) {
+      return impl_.sweep(max_buckets);
+    }
+
+    // エントリが占めるバイト数(キーと値、エントリのヘッダの合計)の上限を設定する。0 なら制限なし。(デフォルト)
+    // 上限を越える store() は、CLOCK で選んだ最近検索されていないエントリを追い出してから追加する。(キャッシュとしての利用)
+    // 最近検索されたかどうか(CLOCK の参照ビット)は、最初に上限を設定した時に共有メモリ上に作る表に記録される。
+    // 表を作れなかった場合は false を返す。(その場合も上限は設定されるが、追い出すエントリは最近検索されたかどうかに依らなくなる)
+    // NOTE: 上限は共有メモリに書き込まれるので、同じテーブルを使う全プロセスに反映される
+    // NOTE: 上限はエントリの大きさのみを数える(ノードや、読み込み側がまだ参照している古いroot等は含まない)ので、
+    //       共有メモリ領域には余裕を持たせること。先に尽きた場合 store() は false を返す。
+    //       (追い出したエントリの領域は、それを含む古いrootを参照する読み込み側がいなくなった時点で回収される)
+    bool setByteBudget(uint64_t bytes) {
+      return impl_.setByteBudget(bytes);
+    }
+
+    // threshold バイト以上の値の重複を排除する。同じ内容の値は共有メモリ上で一つの Blob にまとめられ、
+    // 既に格納されている値と同じ値の store() は、値のハッシュ値の計算と比較のみで済む。(値はコピーされない)
+    // slot_count は値の種類を覚えておく表の大きさで、これを越える種類の値がある場合は一部の重複が排除されないことがある。(0 は不可)
+    // 表は登録した Blob を参照し続けるので、どのエントリからも使われなくなった値も最大 slot_count 個までは解放されずに残る。
+    // NOTE: 設定は共有メモリに書き込まれるので、同じテーブルを使う全プロセスに反映される。(無効に戻すことはできない)
+    //       setValueCodec() と併用した場合は、圧縮後の値で重複を判定する
+    bool enableDedup(uint32_t threshold=128, uint32_t slot_count=4096) {
+      return impl_.enableDedup(threshold, slot_count);
+    }
+
+    // threshold バイト以上の値を codec で圧縮して格納する。(codec が NULL なら圧縮しない。デフォルト)
+    // 圧縮された値は検索で読み出される時に View 内部のバッファに伸長される。(圧縮されていない値は従来通りコピーされない)
+    // 組み込みの方式として codec::LZ がある。
+    // テーブルには最初に設定された方式(Codec::id())が記録され、それと異なる codec を設定しようとすると false を返す。(設定は変わらない)
+    // codec を設定していないプロセスや伸長に失敗した場合は、圧縮された値の検索は無効な値(String::invalid())を返す。
+    // NOTE: 同じテーブルを読む全てのプロセスで同じ codec を設定すること。(threshold は書き込み側のみで使われる)
+    //       また stats() や容量制限は、圧縮された値については圧縮後のサイズで数える
+    bool setValueCodec(const codec::Codec * codec, uint32_t threshold=64) {
+      return impl_.setValueCodec(codec, threshold);
+    }
+
+    // threshold バイト以上の値を、共有メモリではなく filepath に対応付けた(追記のみの)領域に置くようにする。
+    // 値はページキャッシュ経由で読まれるので、共有メモリの大きさ(と 256MB の上限)を越える量の値を保持できる。
+    // 領域が一杯になった後は、通常通り共有メモリに置かれる。(領域内の古い値は回収されない)
+    // NOTE: 同じテーブルを使う全てのプロセスで、読み書きの前に同じファイル・大きさで呼び出すこと
+    // ファイルを対応付けられなかった場合は false を返す。(領域は設定されず、別領域に置かれた値は読めない。find() は無効な値を返す)
+    bool attachValueRegion(const std::string & filepath, uint64_t size, uint32_t threshold, mode_t mode=0660) {
+      assert(value_shm_ == NULL);
+      value_shm_ = new ipc::SharedMemory(filepath, size, mode);
+      value_alc_ = *value_shm_ ? new allocator::LogAllocator(value_shm_->ptr<void>(), size, threshold) : NULL;
+      if(value_alc_ == NULL || ! *value_alc_) {
+        delete value_alc_;
+        delete value_shm_;
+        value_alc_ = NULL;
+        value_shm_ = NULL;
+        return false;
+      }
+      value_alc_->initOnce();
+      impl_.attachColdRegion(value_alc_);
+      return true;
+    }
+
+    // draft のエントリを公開中のテーブルに合わせる。
+    // 両方に存在するキーは policy に従って選ぶ (デフォルトでは draft 側の値で上書きする)。
+    // 新しいrootの公開は一度だけで、コストは両者で重なっている部分木のサイズにのみ比例する。
+    void merge(const Draft & draft, trie::MergePolicy policy=trie::PREFER_RIGHT);
+
+    // View::dump() で書き出したテーブルを読み込んで、公開中のテーブルに合わせる。(成功した場合は true)
+    // 書き出し元とは共有メモリの大きさや ResizePolicy、codec などの設定が異なっていても良い。(このテーブルの設定で格納し直される)
+    // 読み込んだエントリからは、キー毎の store() ではなく公開されていないテーブルを一度に組み立て、merge() と同様に一度だけ公開する。
+    // 組み立てている間も読み込み側は公開中のテーブルを参照し続けられる。両方に存在するキーは policy に従って選ぶ。
+    // ファイル内で同じキーが複数回現れる場合は後のものを使う。終端のエントリ数が合わない場合は何も公開せずに false を返す。
+    // NOTE: store() と同様に書き込み操作なので、他の書き込みとは直列化すること
+    bool restore(const std::string & filepath, trie::MergePolicy policy=trie::PREFER_RIGHT) {
+      return impl_.restore(filepath, policy);
+    }
+
+    // fd (ファイルの他にパイプやソケットでも良い) から読み込む
+    bool restore(int fd, trie::MergePolicy policy=trie::PREFER_RIGHT) {
+      return impl_.restore(fd, policy);
     }
 
     /*
@@ -76,44 +194,299 @@ namespace iht {
   private:
     ipc::SharedMemory shm_;
     trie::HashTrieImpl impl_;
+    ipc::SharedMemory * value_shm_;
+    allocator::LogAllocator * value_alc_;
   };
   
+  // 公開されていないテーブル。
+  // 同じ共有メモリ上に構築した後に HashTrie::merge() で公開中のテーブルにまとめて合わせるために使う。
+  class Draft {
+  public:
+    Draft(HashTrie & trie)
+      : trie_(trie),
+        root_(trie.getImpl().createRoot())
+    {
+    }
+
+    ~Draft() {
+      trie_.getImpl().undupRoot(root_);
+    }
+
+    void store(const String & key, const String & value) {
+      root_ = trie_.getImpl().store(root_, key, value);
+    }
+
+    size_t size() const {
+      return trie_.getImpl().size(root_);
+    }
+
+    trie::md_t root() const { return root_; }
+    
+  private:
+    Draft(const Draft &);
+    Draft & operator=(const Draft &);
+    
+  private:
+    HashTrie & trie_;
+    trie::md_t root_;
+  };
+
+  inline void HashTrie::merge(const Draft & draft, trie::MergePolicy policy) {
+    // TODO: acquire lock
+    impl_.merge(draft.root(), policy);
+  }
+  
   class View {
   public:
-    View(HashTrie & trie)
+    // cache_bits が 0 でない場合は、2^cache_bits 個のスロットを持つ検索結果のキャッシュを使う。
+    // (一部のキーに検索が集中する場合に有効。キャッシュは新しいrootを参照する度に無効になる)
+    //
+    // rootは共有メモリ上の読み込み用スロットに書き込むことで参照する。(スロットに空きがない場合はrootの参照カウントを使う)
+    View(HashTrie & trie, uint32_t cache_bits=0)
       : trie_(trie),
-        root_(trie.getImpl().dupRoot())
+        generation_(trie.getImpl().getGeneration()),
+        slot_(trie.getImpl().acquireReaderSlot()),
+        root_(trie.getImpl().pinRoot(slot_)),
+        cache_(cache_bits)
     {
     }
 
     ~View() {
-      trie_.getImpl().undupRoot(root_);
+      trie_.getImpl().unpinRoot(slot_, root_);
+      trie_.getImpl().releaseReaderSlot(slot_);
     }
 
+    // NOTE: Blobに分割格納されている大きな値や圧縮されている値はView内部のバッファに連結(伸長)して返すので、
+    //       そのStringは次に find() か findMany() を呼び出すまでしか有効ではない。
     String find(const String & key) const {
-      return trie_.getImpl().find(root_, key);
+      if(cache_) {
+        return trie_.getImpl().find(root_, key, buf_, cache_, generation_);
+      }
+      return trie_.getImpl().find(root_, key, buf_);
+    }
+
+    // hash は key のハッシュ値。(HashTrie::store() に渡したものと同じハッシュ関数で求めたもの)
+    String find(const String & key, uint32_t hash) const {
+      if(cache_) {
+        return trie_.getImpl().find(root_, key, hash, buf_, cache_, generation_);
+      }
+      return trie_.getImpl().find(root_, key, hash, buf_);
+    }
+
+    // keys[i] の検索結果を results[i] に格納する。
+    // find() を count 回呼ぶのと同じ結果になるが、プリフェッチを挟みながら複数キーの探索を並行して進めるので高速。
+    // NOTE: キーのハッシュ値は String::hash() で求めるので、独自のハッシュ値で格納したテーブルでは下のものを使うこと
+    void findMany(const String * keys, String * results, size_t count) const {
+      trie_.getImpl().findMany(root_, keys, NULL, results, count, bufs_);
+    }
+
+    // hashes[i] は keys[i] のハッシュ値。(find(key, hash) を count 回呼ぶのと同じ)
+    void findMany(const String * keys, const uint32_t * hashes, String * results, size_t count) const {
+      trie_.getImpl().findMany(root_, keys, hashes, results, count, bufs_);
+    }
+
+    void findMany(const std::vector<String> & keys, std::vector<String> & results) const {
+      results.resize(keys.size());
+      if(! keys.empty()) {
+        findMany(&keys[0], &results[0], keys.size());
+      }
+    }
+
+    void findMany(const std::vector<String> & keys, const std::vector<uint32_t> & hashes, std::vector<String> & results) const {
+      assert(keys.size() == hashes.size());
+      results.resize(keys.size());
+      if(! keys.empty()) {
+        findMany(&keys[0], &hashes[0], &results[0], keys.size());
+      }
     }
 
     size_t size() const {
       return trie_.getImpl().size(root_);
     }
 
+    // リスト(バケット)の数を返す。size() / buckets() が平均リスト長となる。
+    size_t buckets() const {
+      return trie_.getImpl().buckets(root_);
+    }
+
+    // エントリ数、キーと値の合計バイト数を返す。(期限切れのエントリは含まない)
+    // 各ノードが集計値を保持しているので、有効期限を持つエントリがなければ O(1)。あれば、それを含む部分木を走査する。
+    trie::Stats stats() const {
+      return trie_.getImpl().stats(root_);
+    }
+
+    // キーのハッシュ値の下位 4*level ビットが prefix と一致するエントリ群(level段目の部分木)の集計値を返す。
+    // 有効期限を持つエントリがなければ O(level)。(stats() と同様に期限切れのエントリは含まない)
+    trie::Stats stats(uint32_t prefix, uint32_t level) const {
+      return trie_.getImpl().stats(root_, prefix, level);
+    }
+
+    // key に対応する値の offset バイト目から最大 size バイトを value に格納する。(キーが存在しない場合は false を返す)
+    // 大きな値でも、範囲に含まれるチャンクのみを読み込むので、値全体を連結する必要はない。
+    bool read(const String & key, uint32_t offset, uint32_t size, std::string & value) const {
+      return trie_.getImpl().read(root_, key, offset, size, value);
+    }
+
     template <class Callback>
     void foreach(Callback & callback) {
       trie_.getImpl().foreach(root_, callback);
     }
 
-    // XXX: MT非対応
+    // prefix で始まるキーのエントリを、キーの辞書順に callback(key, value) に渡す。
+    // コストは列挙するエントリの数に比例する。(テーブルが ResizePolicy::ordered_index で作られていない場合は false を返す)
+    // NOTE: callback に渡す値(String)は、次のエントリを渡すまでしか有効ではない
+    template <class Callback>
+    bool scanPrefix(const String & prefix, Callback & callback) const {
+      return trie_.getImpl().scanPrefix(root_, prefix, callback);
+    }
+
+    // begin 以上 end 未満のキーのエントリを、キーの辞書順に callback(key, value) に渡す。(end を省略すると上限なし)
+    template <class Callback>
+    bool scanRange(const String & begin, const String & end, Callback & callback) const {
+      return trie_.getImpl().scanRange(root_, begin, end, callback);
+    }
+
+    template <class Callback>
+    bool scanRange(const String & begin, Callback & callback) const {
+      return trie_.getImpl().scanRange(root_, begin, String::invalid(), callback);
+    }
+
+    // このViewが参照しているテーブルを、読み込み専用の FrozenTable の形式で filepath に書き出す。(成功した場合は true)
+    // 書き出したファイルは FrozenTable で(任意の数のプロセスから)対応付けて検索できる。
+    // 一時ファイルに書いてから置き換えるので、同じファイルを既に対応付けている読み込み側はそのまま古い内容を参照し続ける。
+    // 値を読めないエントリ(別領域が設定されていない場合など)があった場合は、何も書き出さずに false を返す。
+    bool freeze(const std::string & filepath, mode_t mode=0660) const {
+      return trie_.getImpl().freeze(root_, filepath, mode);
+    }
+
+    // このViewが参照しているテーブルを、ホストや共有メモリの大きさに依存しない形式(dump.hh を参照)で filepath に書き出す。
+    // 書き出したものは HashTrie::restore() で読み込める。固定したrootを辿るので、書き込み側は書き出し中も更新を続けられる。
+    // NOTE: freeze() と同様に、値を読めないエントリ(別領域が設定されていない場合など)があった場合は false を返す
+    bool dump(const std::string & filepath, mode_t mode=0660) const {
+      return trie_.getImpl().dump(root_, filepath, mode);
+    }
+
+    // fd (ファイルの他にパイプやソケットでも良い) に書き出す
+    bool dump(int fd) const {
+      return trie_.getImpl().dump(root_, fd);
+    }
+
+    // 一様ランダムに選んだ count 個のエントリ(重複あり)を callback(key, value) に渡す。(期限切れのエントリは選ばない)
+    // rng() は一様分布の uint32_t 値を返す乱数生成器。(e.g. std::mt19937)
+    // 各部分木のエントリ数を使って該当するエントリまで直接辿るので、一つのサンプルあたり O(depth) で済む。
+    // (期限切れのエントリを引いた場合は選び直すので、それが多い場合は sweep() で取り除いておくと良い)
+    template <class Random, class Callback>
+    void sample(uint32_t count, Random & rng, Callback & callback) const {
+      trie_.getImpl().sample(root_, count, rng, callback);
+    }
+
+    // count 個のサンプルから、値のサイズ分布やキー長のヒストグラムを推定する。(期限切れのエントリの扱いは sample() と同様)
+    template <class Random>
+    Sketch sketch(uint32_t count, Random & rng) const {
+      Sketch sketch;
+      trie_.getImpl().sketch(root_, count, rng, sketch);
+      return sketch;
+    }
+
+    // 新しいrootが公開されていれば、それを参照し直す。(公開されていなければ世代を読むだけで済む)
+    // NOTE: 一つの View を複数のスレッドから同時に使ってはいけない。(スレッド毎の View は ThreadView で得られる)
     void updateIfNeed() {
-      if(root_ != trie_.getImpl().getRoot()) {
-        trie_.getImpl().undupRoot(root_);
-        root_ = trie_.getImpl().dupRoot();
+      uint32_t generation = trie_.getImpl().getGeneration();
+      if(generation != generation_) {
+        trie_.getImpl().unpinRoot(slot_, root_);
+        generation_ = generation;
+        root_ = trie_.getImpl().pinRoot(slot_);
       }
     }
 
+    // このViewが参照しているものより新しいrootが公開されるまで待機する。
+    // 公開された場合は true を、timeout_us(マイクロ秒)が経過した場合は false を返す (負の場合は無期限)。
+    // 新しいrootを参照するには、続けて updateIfNeed() を呼び出す必要がある。
+    bool waitForChange(long timeout_us=-1) const {
+      return trie_.getImpl().waitForChange(generation_, timeout_us);
+    }
+
   private:
     HashTrie & trie_;
+    uint32_t generation_; // root_ の取得直前に読んだ世代 (root_ より古いことはあっても新しいことはない)
+    const int slot_;      // 読み込み用スロットの添字 (-1 ならrootの参照カウントを使う)
     trie::md_t root_;
+    mutable std::string buf_;
+    mutable std::vector<std::string> bufs_;
+    mutable trie::FindCache cache_; // root_ と同じ世代(generation_)で検索したエントリのみが有効
+  };
+
+  // スレッド毎に一つずつ View を保持して使い回すためのクラス。
+  // get() は呼び出したスレッドの View を、新しいrootが公開されていればそれを参照し直した上で返す。
+  // View の生成(読み込み用スロットの確保)とrootの参照し直しは、スレッド毎の初回と新しいrootが公開された時のみなので、
+  // 定常状態の検索ではrootの世代を読む以外に共有メモリにアクセスしない。
+  //
+  // 各スレッドの View はスレッドの終了時に解放される。
+  // NOTE: ThreadView は、それを使う全てのスレッドより長く生存していなければならない
+  class ThreadView {
+    struct Holder {
+      Holder(ThreadView & owner, HashTrie & trie, uint32_t cache_bits) : owner(owner), view(trie, cache_bits) {}
+      
+      ThreadView & owner;
+      View view;
+    };
+    
+  public:
+    ThreadView(HashTrie & trie, uint32_t cache_bits=0)
+      : trie_(trie),
+        cache_bits_(cache_bits)
+    {
+      int ret = pthread_key_create(&key_, &ThreadView::onThreadExit);
+      assert(ret == 0);
+      
+      ret = pthread_mutex_init(&mtx_, NULL);
+      assert(ret == 0);
+    }
+
+    ~ThreadView() {
+      pthread_key_delete(key_);
+      for(size_t i=0; i < holders_.size(); i++) {
+        delete holders_[i];
+      }
+      pthread_mutex_destroy(&mtx_);
+    }
+
+    View & get() {
+      Holder * holder = static_cast<Holder*>(pthread_getspecific(key_));
+      if(holder == NULL) {
+        holder = new Holder(*this, trie_, cache_bits_);
+        pthread_setspecific(key_, holder);
+        
+        pthread_mutex_lock(&mtx_);
+        holders_.push_back(holder);
+        pthread_mutex_unlock(&mtx_);
+      } else {
+        holder->view.updateIfNeed();
+      }
+      return holder->view;
+    }
+    
+  private:
+    static void onThreadExit(void * p) {
+      Holder * holder = static_cast<Holder*>(p);
+      ThreadView & owner = holder->owner;
+      
+      pthread_mutex_lock(&owner.mtx_);
+      owner.holders_.erase(std::find(owner.holders_.begin(), owner.holders_.end(), holder));
+      pthread_mutex_unlock(&owner.mtx_);
+      
+      delete holder;
+    }
+
+    ThreadView(const ThreadView &);
+    ThreadView & operator=(const ThreadView &);
+    
+  private:
+    HashTrie & trie_;
+    const uint32_t cache_bits_;
+    pthread_key_t key_;
+    pthread_mutex_t mtx_;
+    std::vector<Holder*> holders_; // 全スレッドの View (ThreadView の破棄時に残っているものを解放する)
   };
 }
 
@@ -0,0 +1,29 @@
+#ifndef __IHT_IPC_FUTEX_HH__
+#define __IHT_IPC_FUTEX_HH__
+
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace iht {
+  namespace ipc {
+    // プロセス間で共有されたメモリ領域上の32bit値を使って待機/通知を行うための薄いラッパー。
+    // (FUTEX_PRIVATE_FLAG を付けないので、別プロセスからの wake も受け取れる)
+    namespace futex {
+      // *addr == expected の間、wake されるか timeout が経過するまで待機する。
+      // timeout は相対時間で、NULL の場合は無期限に待つ。
+      inline int wait(uint32_t * addr, uint32_t expected, const timespec * timeout) {
+        return syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+      }
+
+      // addr で待機中のスレッドを最大 count 個起こす。
+      inline int wake(uint32_t * addr, int count) {
+        return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+      }
+    }
+  }
+}
+
+#endif
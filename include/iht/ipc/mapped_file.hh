@@ -0,0 +1,54 @@
+#ifndef __IHT_IPC_MAPPED_FILE_HH__
+#define __IHT_IPC_MAPPED_FILE_HH__
+
+#include <string>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h> 
+#include <fcntl.h>
+
+namespace iht {
+  namespace ipc {
+    // 既存のファイル全体を読み込み専用で対応付ける。(同じファイルを対応付けた全プロセスでページキャッシュが共有される)
+    class MappedFile {
+    public:
+      MappedFile(const std::string& filepath) : ptr_(MAP_FAILED), size_(0) {
+	int fd = open(filepath.c_str(), O_RDONLY);
+	if(fd == -1) {
+	  return;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size > 0) {
+	  size_ = st.st_size;
+	  ptr_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+      }
+    
+      ~MappedFile() {
+	if(ptr_ != MAP_FAILED) {
+	  munmap(ptr_, size_);
+	}
+      }
+
+      operator bool() const { return ptr_ != MAP_FAILED; }
+
+      template <class T>
+      const T* ptr(size_t offset=0) const { return *this ? reinterpret_cast<const T*>(reinterpret_cast<const char*>(ptr_)+offset) : NULL; }
+  
+      size_t size() const { return size_; }
+    
+    private:
+      MappedFile(const MappedFile &);
+      MappedFile & operator=(const MappedFile &);
+
+    private:
+      void* ptr_;
+      size_t size_;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef __IHT_SKETCH_HH__
+#define __IHT_SKETCH_HH__
+
+#include <inttypes.h>
+#include <algorithm>
+#include <vector>
+
+namespace iht {
+  // ランダムサンプリングしたエントリから、テーブル全体の統計量を推定するためのクラス。
+  // (View::sketch() を参照)
+  class Sketch {
+  public:
+    static const uint32_t HISTOGRAM_SIZE = 33;
+    
+    Sketch()
+      : population_(0),
+        key_length_histogram_(HISTOGRAM_SIZE, 0),
+        sorted_(true)
+    {
+    }
+
+    void add(uint32_t key_size, uint32_t value_size) {
+      key_length_histogram_[bucket(key_size)]++;
+      value_sizes_.push_back(value_size);
+      sorted_ = false;
+    }
+
+    // サンプリング元のエントリ数
+    void setPopulation(uint64_t population) { population_ = population; }
+    uint64_t population() const { return population_; }
+    
+    size_t sampleCount() const { return value_sizes_.size(); }
+
+    // 値のサイズの p パーセンタイル (0 <= p <= 100)
+    uint32_t valueSizePercentile(double p) {
+      if(value_sizes_.empty()) {
+        return 0;
+      }
+      if(! sorted_) {
+        std::sort(value_sizes_.begin(), value_sizes_.end());
+        sorted_ = true;
+      }
+      
+      size_t i = static_cast<size_t>(p / 100 * (value_sizes_.size() - 1) + 0.5);
+      return value_sizes_[std::min(i, value_sizes_.size() - 1)];
+    }
+
+    double meanValueSize() const {
+      if(value_sizes_.empty()) {
+        return 0;
+      }
+      
+      uint64_t sum = 0;
+      for(size_t i=0; i < value_sizes_.size(); i++) {
+        sum += value_sizes_[i];
+      }
+      return static_cast<double>(sum) / value_sizes_.size();
+    }
+
+    // キー長のヒストグラム。
+    // i番目の要素は、長さが [2^(i-1), 2^i) の範囲にあるキーの(推定)割合。(0番目は長さ0のキー)
+    std::vector<double> keyLengthHistogram() const {
+      std::vector<double> ratios(HISTOGRAM_SIZE, 0);
+      if(! value_sizes_.empty()) {
+        for(uint32_t i=0; i < HISTOGRAM_SIZE; i++) {
+          ratios[i] = static_cast<double>(key_length_histogram_[i]) / value_sizes_.size();
+        }
+      }
+      return ratios;
+    }
+
+  private:
+    static uint32_t bucket(uint32_t n) {
+      uint32_t i = 0;
+      for(; n != 0; n >>= 1) {
+        i++;
+      }
+      return i;
+    }
+    
+  private:
+    uint64_t population_;
+    std::vector<uint32_t> key_length_histogram_;
+    std::vector<uint32_t> value_sizes_;
+    bool sorted_;
+  };
+}
+
+#endif
@@ -51,7 +51,7 @@ namespace iht {
       if(size() != s.size()) {
         return false;
       }
-      return strncmp(data(), s.data(), size()) == 0;
+      return memcmp(data(), s.data(), size()) == 0; // キーは任意のバイト列(e.g. 整数)なので NUL で止まってはいけない
     }
 
     static String invalid() { return String(reinterpret_cast<const char*>(1), 
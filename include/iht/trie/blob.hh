@@ -0,0 +1,109 @@
+#ifndef __IHT_TRIE_BLOB_HH__
+#define __IHT_TRIE_BLOB_HH__
+
+#include "../allocator/fixed_allocator.hh"
+#include "../string.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+#include <cassert>
+
+namespace iht {
+  namespace trie {
+    // 大きな値を CHUNK_SIZE バイト毎のチャンクに分割して格納するブロック。
+    // 各チャンクは FixedAllocator の最大ブロックサイズに収まるので、VariableAllocator の先頭適合探索を経ずにフリーリストから割り当てられる。
+    // Blob は不変かつ参照カウントで共有されるので、エントリをコピーしても値自体がコピーされることはない。
+    // 最後のチャンクは値の残りの分だけを割り当てる。(チャンクが一つの値は、連結せずにそのまま参照できる)
+    class Blob {
+      typedef uint32_t md_t;
+      typedef allocator::FixedAllocator Alc;
+
+    public:
+      static const uint32_t CHUNK_SIZE = 4096;
+
+      static md_t create(Alc & alc, const String & value) {
+        uint32_t chunk_count = (value.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        md_t md = alc.allocate(sizeof(Blob) + sizeof(md_t)*chunk_count);
+        assert(md != 0);
+
+        Blob * blob = alc.ptr<Blob>(md);
+        blob->size_ = value.size();
+        blob->chunk_count_ = chunk_count;
+        for(uint32_t i=0; i < chunk_count; i++) {
+          uint32_t offset = i * CHUNK_SIZE;
+          uint32_t size = value.size() - offset < CHUNK_SIZE ? value.size() - offset : CHUNK_SIZE;
+          
+          blob->chunks_[i] = alc.allocate(size);
+          assert(blob->chunks_[i] != 0);
+          memcpy(alc.ptr<char>(blob->chunks_[i]), value.data() + offset, size);
+        }
+        return md;
+      }
+
+      // size バイトの値の Blob を create() するのに割り当てるバイト数の上限
+      static uint64_t sizeBound(uint32_t size) {
+        const uint32_t chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        return Alc::blockSize(sizeof(Blob) + sizeof(md_t)*chunk_count) +
+               static_cast<uint64_t>(chunk_count) * Alc::blockSize(CHUNK_SIZE);
+      }
+
+      static void release(md_t md, Alc & alc) {
+        if(alc.undup(md)) {
+          const Blob * blob = alc.ptr<Blob>(md);
+          for(uint32_t i=0; i < blob->chunk_count_; i++) {
+            alc.release(blob->chunks_[i]);
+          }
+          alc.release_no_undup(md);
+        }
+      }
+
+      uint32_t size() const { return size_; }
+
+      // 値が一つのチャンクに収まっている場合は、その先頭を返す。(そうでなければ NULL)
+      const char * contiguous(const Alc & alc) const {
+        return chunk_count_ == 1 ? alc.ptr<char>(chunks_[0]) : NULL;
+      }
+
+      // 値が value と等しいかどうか (連結せずにチャンク毎に比較する)
+      bool equals(const String & value, const Alc & alc) const {
+        if(value.size() != size_) {
+          return false;
+        }
+        for(uint32_t i=0; i < chunk_count_; i++) {
+          uint32_t offset = i * CHUNK_SIZE;
+          uint32_t size = size_ - offset < CHUNK_SIZE ? size_ - offset : CHUNK_SIZE;
+          if(memcmp(alc.ptr<char>(chunks_[i]), value.data() + offset, size) != 0) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      // offset バイト目から最大 size バイトを buf の末尾に追加する。追加したバイト数を返す。
+      // 範囲に含まれるチャンクのみを参照する。
+      uint32_t read(uint32_t offset, uint32_t size, std::string & buf, const Alc & alc) const {
+        if(offset >= size_) {
+          return 0;
+        }
+        
+        uint32_t end = size < size_ - offset ? offset + size : size_;
+        for(uint32_t pos = offset; pos < end;) {
+          uint32_t i = pos / CHUNK_SIZE;
+          uint32_t chunk_offset = pos % CHUNK_SIZE;
+          uint32_t n = end - pos < CHUNK_SIZE - chunk_offset ? end - pos : CHUNK_SIZE - chunk_offset;
+          
+          buf.append(alc.ptr<char>(chunks_[i]) + chunk_offset, n);
+          pos += n;
+        }
+        return end - offset;
+      }
+
+    private:
+      uint32_t size_;
+      uint32_t chunk_count_;
+      md_t chunks_[0];
+    };
+  }
+}
+
+#endif
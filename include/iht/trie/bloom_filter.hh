@@ -0,0 +1,109 @@
+#ifndef __IHT_TRIE_BLOOM_FILTER_HH__
+#define __IHT_TRIE_BLOOM_FILTER_HH__
+
+#include "../atomic/atomic.hh"
+#include "../allocator/fixed_allocator.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <cassert>
+
+namespace iht {
+  namespace trie {
+    // キーのハッシュ値を登録するブロック化Bloomフィルタ。
+    // 一つのキーのビットは全て一つのブロック(64バイト = キャッシュライン一本)に収まるので、検査は一回のメモリ参照で済む。
+    //
+    // ビットは追加されるのみなので、新しいrootのための追加を古いrootと共有しているフィルタに直接行っても、
+    // 古いrootにとっては偽陽性が増えるだけで偽陰性は生じない。(エントリが削除された場合も同様)
+    // 公開中のrootの読み込み側と同じワードを読み書きするので、ワードの読み書きは全て atomic::load() と atomic::store() で行う。
+    // NOTE: 書き込みは(テーブルの更新と同様に)直列化されている前提。
+    //       他に書き込む者がいないので、add() のワード毎の読み込みと書き込みの組は、ロック命令を使わない fetch_or に相当する。
+    class BloomFilter {
+      typedef uint32_t md_t;
+      typedef allocator::FixedAllocator Alc;
+
+      static const uint32_t BLOCK_BITS = 512;
+      static const uint32_t HASH_COUNT = 4;
+
+      struct Block {
+        uint64_t words[BLOCK_BITS / 64];
+      };
+      
+    public:
+      // capacity 個のキーを、キーあたり bits_per_key ビットで登録できるフィルタを割り当てる
+      static md_t create(uint32_t capacity, uint32_t bits_per_key, Alc & alc) {
+        const uint32_t block_count = blockCount(capacity, bits_per_key);
+        
+        md_t md = alc.allocate(sizeOf(capacity, bits_per_key));
+        assert(md != 0);
+
+        BloomFilter * filter = alc.ptr<BloomFilter>(md);
+        filter->capacity_ = capacity;
+        filter->block_count_ = block_count;
+        memset(filter->blocks_, 0, sizeof(Block) * block_count);
+        return md;
+      }
+
+      // create(capacity, bits_per_key) が割り当てるフィルタのサイズ
+      static uint32_t sizeOf(uint32_t capacity, uint32_t bits_per_key) {
+        return sizeof(BloomFilter) + sizeof(Block) * blockCount(capacity, bits_per_key);
+      }
+
+      // このフィルタの偽陽性率を保ったまま登録できるキーの数
+      uint32_t capacity() const { return capacity_; }
+      
+      void add(uint32_t hash) {
+        const uint64_t h = mix(hash);
+        Block & block = blocks_[blockIndex(h)];
+        for(uint32_t i=0; i < HASH_COUNT; i++) {
+          const uint32_t bit = bitIndex(h, i);
+          uint64_t * word = &block.words[bit / 64];
+          atomic::store(word, atomic::load(word) | (static_cast<uint64_t>(1) << (bit % 64)));
+        }
+      }
+      
+      // false の場合は、ハッシュ値 hash のキーは確実に登録されていない
+      bool mayContain(uint32_t hash) const {
+        const uint64_t h = mix(hash);
+        const Block & block = blocks_[blockIndex(h)];
+        for(uint32_t i=0; i < HASH_COUNT; i++) {
+          const uint32_t bit = bitIndex(h, i);
+          if((atomic::load(&block.words[bit / 64]) & (static_cast<uint64_t>(1) << (bit % 64))) == 0) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      const void * blockOf(uint32_t hash) const { return &blocks_[blockIndex(mix(hash))]; }
+      
+    private:
+      static uint32_t blockCount(uint32_t capacity, uint32_t bits_per_key) {
+        return static_cast<uint64_t>(capacity) * bits_per_key / BLOCK_BITS + 1;
+      }
+
+      // キーのハッシュ値(32bit)を64bitに拡散する (splitmix64の最終段)
+      static uint64_t mix(uint32_t hash) {
+        uint64_t h = hash * 0x9E3779B97F4A7C15ULL;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        return h ^ (h >> 31);
+      }
+
+      uint32_t blockIndex(uint64_t h) const {
+        return ((h >> 32) * block_count_) >> 32;
+      }
+
+      // 下位 9*HASH_COUNT ビットを9ビットずつ使う
+      static uint32_t bitIndex(uint64_t h, uint32_t i) {
+        return (h >> (9*i)) & (BLOCK_BITS - 1);
+      }
+      
+    private:
+      uint32_t capacity_;
+      uint32_t block_count_;
+      Block blocks_[0];
+    };
+  }
+}
+
+#endif
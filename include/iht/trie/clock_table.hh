@@ -0,0 +1,71 @@
+#ifndef __IHT_TRIE_CLOCK_TABLE_HH__
+#define __IHT_TRIE_CLOCK_TABLE_HH__
+
+#include "../atomic/atomic.hh"
+#include "../allocator/fixed_allocator.hh"
+#include <inttypes.h>
+#include <string.h>
+
+namespace iht {
+  namespace trie {
+    // 容量制限による追い出し(CLOCK)の参照ビットの表。(キーのハッシュ値 → 最近検索されたかどうか)
+    // 公開中のリスト(とエントリ)をその場で書き換えずに済むように、参照ビットはエントリではなくこの表に持たせる。
+    //
+    // 各スロットは一バイトで、他のフィールドとワードを共有しない。
+    // 読み込み側は(立っていなければ)バイトの書き込みで立て、書き込み側は追い出しの候補を探す際に落とす。
+    // 競合して書き込みが失われても、近似の精度が落ちるだけ。
+    // ハッシュ値の下位ビットが同じエントリはスロットを共有する。(一方の検索で他方も最近検索されたとみなされる)
+    class ClockTable {
+      typedef uint32_t md_t;
+      typedef allocator::FixedAllocator Alc;
+
+    public:
+      static const uint32_t MIN_SLOT_COUNT = 1 << 10;
+      static const uint32_t MAX_SLOT_COUNT = 1 << 22;
+
+      // 容量制限 byte_budget に見合う数のスロットを持つ表を作る。
+      // 共有による参照ビットの取りこぼしを抑えるため、スロットは上限の8バイトにつき一つ(小さなエントリでも数スロットに一つ)とする。
+      static md_t create(uint64_t byte_budget, Alc & alc) {
+        uint32_t slot_count = MIN_SLOT_COUNT;
+        while(slot_count < MAX_SLOT_COUNT && slot_count < byte_budget / 8) {
+          slot_count *= 2;
+        }
+
+        md_t md = alc.allocate(sizeof(ClockTable) + slot_count);
+        if(md == 0) {
+          return 0;
+        }
+
+        ClockTable * table = alc.ptr<ClockTable>(md);
+        table->mask_ = slot_count - 1;
+        memset(table->bits_, 0, slot_count);
+        return md;
+      }
+
+      // 既に立っていれば書き込まないので、よく検索されるエントリのキャッシュラインを汚さない
+      void touch(uint32_t hash) {
+        uint8_t * bit = &bits_[hash & mask_];
+        if(atomic::load(bit) == 0) {
+          atomic::store(bit, 1);
+        }
+      }
+
+      bool isReferenced(uint32_t hash) const {
+        return atomic::load(const_cast<uint8_t*>(&bits_[hash & mask_])) != 0;
+      }
+
+      void clear(uint32_t hash) {
+        uint8_t * bit = &bits_[hash & mask_];
+        if(atomic::load(bit) != 0) {
+          atomic::store(bit, 0);
+        }
+      }
+
+    private:
+      uint32_t mask_;
+      uint8_t bits_[0];
+    };
+  }
+}
+
+#endif
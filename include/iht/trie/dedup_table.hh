@@ -0,0 +1,99 @@
+#ifndef __IHT_TRIE_DEDUP_TABLE_HH__
+#define __IHT_TRIE_DEDUP_TABLE_HH__
+
+#include "blob.hh"
+#include "../allocator/fixed_allocator.hh"
+#include "../string.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <cassert>
+
+namespace iht {
+  namespace trie {
+    // 同じ内容の値を一つの Blob で共有するための表。(値のハッシュ値 → Blob)
+    // 共有メモリ上に置かれ、書き込み側のみが使う。(書き込み側は直列化されているので排他は不要)
+    //
+    // 各スロットは登録した Blob の参照を一つ持つ。候補のスロットが全て埋まっている場合は古いものを上書きする(その参照を解放する)ので、
+    // 重複の排除は最善努力で、表の大きさを越える種類の値がある場合は全ての重複が見つかるとは限らない。
+    //
+    // NOTE: 表の参照は強参照なので、どのエントリからも参照されなくなった Blob も、上書きされるまでは解放されずに残る。
+    //       (残るのは高々 slot_count 個で、表を無効にすることはできないので、この分はテーブルの寿命まで回収されない)
+    class DedupTable {
+      typedef uint32_t md_t;
+      typedef allocator::FixedAllocator Alc;
+
+      static const uint32_t PROBE_LIMIT = 4; // 一つのハッシュ値に対して調べるスロット数
+
+      struct Slot {
+        uint32_t hash;
+        md_t blob; // 空なら 0
+      };
+
+    public:
+      // slot_count 個のスロットを持ち、threshold バイト以上の値を共有する表を作る。(slot_count が 0 の場合や割当に失敗した場合は 0 を返す)
+      static md_t create(uint32_t slot_count, uint32_t threshold, Alc & alc) {
+        if(slot_count == 0 || slot_count > (0xFFFFFFFF - sizeof(DedupTable)) / sizeof(Slot)) {
+          return 0;
+        }
+        md_t md = alc.allocate(sizeof(DedupTable) + sizeof(Slot)*slot_count);
+        if(md == 0) {
+          return 0;
+        }
+        
+        DedupTable * table = alc.ptr<DedupTable>(md);
+        table->threshold_ = threshold;
+        table->slot_count_ = slot_count;
+        memset(table->slots_, 0, sizeof(Slot)*slot_count);
+        return md;
+      }
+
+      uint32_t threshold() const { return threshold_; }
+
+      // value と同じ内容の Blob が登録されていればそれを、なければ新たに作って登録したものを返す。
+      // 返り値の参照は呼び出し側のものになる。(既存の Blob の場合は参照カウントを一つ増やしてから返す)
+      md_t intern(const String & value, Alc & alc) {
+        const uint32_t hash = value.hash();
+        for(uint32_t i=0; i < PROBE_LIMIT; i++) {
+          const Slot & slot = slots_[(hash + i) % slot_count_];
+          if(slot.blob != 0 && slot.hash == hash && alc.ptr<Blob>(slot.blob)->equals(value, alc)) {
+            bool dup_rlt = alc.dup(slot.blob);
+            assert(dup_rlt != false);
+            return slot.blob; // 値のコピーは不要
+          }
+        }
+
+        md_t blob = Blob::create(alc, value);
+        insert(hash, blob, alc);
+        return blob;
+      }
+
+    private:
+      void insert(uint32_t hash, md_t blob, Alc & alc) {
+        // 空きがなければ、最初の候補を上書きする
+        Slot * place = &slots_[hash % slot_count_];
+        for(uint32_t i=0; i < PROBE_LIMIT; i++) {
+          Slot & slot = slots_[(hash + i) % slot_count_];
+          if(slot.blob == 0) {
+            place = &slot;
+            break;
+          }
+        }
+
+        if(place->blob != 0) {
+          Blob::release(place->blob, alc);
+        }
+        bool dup_rlt = alc.dup(blob);
+        assert(dup_rlt != false);
+        place->hash = hash;
+        place->blob = blob;
+      }
+
+    private:
+      uint32_t threshold_;
+      uint32_t slot_count_;
+      Slot slots_[0];
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __IHT_TRIE_FIND_CACHE_HH__
+#define __IHT_TRIE_FIND_CACHE_HH__
+
+#include "node.hh"
+#include "../string.hh"
+#include <inttypes.h>
+#include <vector>
+
+namespace iht {
+  namespace trie {
+    // 検索結果(キーのハッシュ値 → エントリ本体)を覚えておく、読み込み側毎の小さなダイレクトマップキャッシュ。
+    // 一部のキーに検索が集中する場合に、それらのキーの検索をハッシュ値の計算とキャッシュ一箇所の参照(とキー比較)のみで済ませる。
+    //
+    // 各スロットは、エントリを検索した時点のrootの世代で印付けされる。
+    // 世代が異なるスロットは無効とみなすので、新しいrootを参照するようになった時点でキャッシュ全体が暗黙に無効となる。
+    // (エントリへのポインタは、そのrootを参照している間しか有効ではない)
+    class FindCache {
+      struct Slot {
+        uint32_t hash;
+        uint32_t generation;
+        const Entry * entry;
+      };
+      
+    public:
+      // 2^size_bits 個のスロットを持つキャッシュを作る。(size_bits が 0 の場合は何もキャッシュしない)
+      FindCache(uint32_t size_bits)
+        : slots_(size_bits == 0 ? 0 : 1 << size_bits),
+          mask_(slots_.empty() ? 0 : slots_.size() - 1)
+      {
+        // 世代はどの値も取り得るので、空のスロットは entry が NULL であることで区別する (find() を参照)
+        for(size_t i=0; i < slots_.size(); i++) {
+          slots_[i].hash = 0;
+          slots_[i].generation = 0;
+          slots_[i].entry = NULL;
+        }
+      }
+
+      operator bool() const { return ! slots_.empty(); }
+
+      const Entry * find(const String & key, uint32_t hash, uint32_t generation) const {
+        const Slot & slot = slots_[hash & mask_];
+        const Entry * e = slot.entry;
+        if(e == NULL || slot.generation != generation || slot.hash != hash) {
+          return NULL;
+        }
+        return e->keyEquals(key) ? e : NULL;
+      }
+
+      void put(uint32_t hash, uint32_t generation, const Entry * entry) {
+        Slot & slot = slots_[hash & mask_];
+        slot.hash = hash;
+        slot.generation = generation;
+        slot.entry = entry;
+      }
+
+    private:
+      std::vector<Slot> slots_;
+      const uint32_t mask_;
+    };
+  }
+}
+
+#endif
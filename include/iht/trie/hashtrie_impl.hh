@@ -3,34 +3,73 @@
 
 #include "node.hh"
 #include "ref.hh"
+#include "find_cache.hh"
 #include "../string.hh"
+#include "../sketch.hh"
+#include "../frozen_table.hh"
+#include "../dump.hh"
 #include "../allocator/fixed_allocator.hh"
 #include "../ipc/shared_memory.hh"
+#include "../ipc/futex.hh"
 #include <inttypes.h>
+#include <limits.h>
+#include <string>
+#include <vector>
 #include <algorithm>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace iht {
   namespace trie {
-    static const char MAGIC[] = "IHT-0.0.1";
+    static const char MAGIC[] = "IHT-0.0.10";
     
     typedef uint32_t md_t;
 
     class HashTrieImpl {
     private:
+      // 読み込み側(View)がrootを参照していることを示すスロット。
+      // 参照カウント(rootの一つのワード)を全ての読み込み側で増減させる代わりに、各自のスロットにrootを書き込む。
+      // スロット毎にキャッシュラインを分けているので、読み込み側同士で競合することはない。
+      struct ReaderSlot {
+        uint32_t in_use; // 使用中なら 1
+        md_t root;       // 参照中のroot (参照していない場合は 0)
+      } __attribute__((aligned(64)));
+
+      static const uint32_t READER_SLOT_LIMIT = 64;
+      
       struct Header {
         char magic[sizeof(MAGIC)];
         uint32_t shm_size;
         md_t root;
+        uint32_t generation; // rootが公開される度にインクリメントされる (futexの待機対象)
+        uint32_t waiters;    // waitForChange()で待機中のスレッド数
+        ResizePolicy resize_policy;
+        uint32_t reader_slot_count; // これまでに使われたスロットの最大添字+1 (書き込み側はこの範囲のみを走査する)
+        md_t retired;               // 公開を終えたが、まだスロットから参照されているかもしれないrootの連結リスト (RootNode::retiredNext()で辿る)
+        uint32_t sweep_cursor;      // 次の sweep() が調べ始める位置 (RootNode::sweep()を参照)
+        uint32_t clock_cursor;      // 容量制限による追い出しの CLOCK の針 (RootNode::evict()を参照)
+        uint64_t byte_budget;       // エントリが占めるバイト数の上限 (0 なら制限なし。RootNode::footprint()を参照)
+        md_t dedup_table;           // 同じ内容の値を共有するための表 (0 なら共有しない。DedupTableを参照)
+        md_t clock_table;           // 追い出しの CLOCK の参照ビットの表 (容量制限を設定するまでは 0。ClockTableを参照)
+        uint32_t codec_id;          // 値の圧縮方式の識別子 (最初に設定された codec の Codec::id()。設定されるまでは 0)
+        ReaderSlot readers[READER_SLOT_LIMIT];
       };
-      static const uint32_t HEADER_SIZE = sizeof(Header);
+      // アロケータ領域の先頭を8バイト境界に揃える (Nodeの8バイトCASのため)
+      static const uint32_t HEADER_SIZE = (sizeof(Header)+7) & ~7;
       
     public:
-      HashTrieImpl(ipc::SharedMemory & shm)
+      // policy が SINGLE_THREAD の場合は、アロケータやrootの公開・参照でロック命令を使わない。
+      // (shm を一つのプロセスの一つのスレッドからしか使わない場合のみ指定可能)
+      HashTrieImpl(ipc::SharedMemory & shm, const ResizePolicy & resize_policy=ResizePolicy(),
+                   atomic::Policy policy=atomic::MULTI_THREAD)
         : shm_size_(shm.size()),
+          resize_policy_(resize_policy),
+          policy_(policy),
           h_(shm.ptr<Header>()),
-          alc_(shm.ptr<void>(HEADER_SIZE), std::max(0, static_cast<int32_t>(shm.size() - HEADER_SIZE)))
+          alc_(shm.ptr<void>(HEADER_SIZE), std::max(0, static_cast<int32_t>(shm.size() - HEADER_SIZE)), policy),
+          compress_threshold_(0)
       {
       }
 
@@ -42,17 +81,23 @@ namespace iht {
           
           memcpy(h_->magic, MAGIC, sizeof(MAGIC));
           h_->shm_size = shm_size_;
-          h_->root = alc_.allocate(sizeof(RootNode));
+          h_->generation = 0;
+          h_->waiters = 0;
+          h_->resize_policy = resize_policy_;
+          h_->reader_slot_count = 0;
+          h_->retired = 0;
+          h_->sweep_cursor = 0;
+          h_->clock_cursor = 0;
+          h_->byte_budget = 0;
+          h_->dedup_table = 0;
+          h_->clock_table = 0;
+          h_->codec_id = 0;
+          memset(static_cast<void*>(h_->readers), 0, sizeof(h_->readers));
+          h_->root = RootNode::create(resize_policy_, alc_);
           if(h_->root == 0) {
             h_ = NULL;
             return;
           }
-
-          RootNode * node = new (alc_.ptr<RootNode>(h_->root)) RootNode(alc_);
-          if(! *node) {
-            h_ = NULL;
-            return;
-          }
         }
       }
       
@@ -65,22 +110,136 @@ namespace iht {
         }
       }
 
-      void store(const String & key, const String & value) {
-        //md_t old;
-        for(;;) {
-          Ref<RootNode> root(h_->root, alc_);
-          if(! root) {
-            continue;
+      bool store(const String & key, const String & value) {
+        return store(key, value, key.hash());
+      }
+
+      // hash は key のハッシュ値。(String::hash() 以外のハッシュ関数を使う場合は、テーブル全体でそれに統一すること)
+      // expires_at が 0 でない場合は、それをエントリの有効期限(Entry::now()基準の秒)とする。
+      // 共有メモリ領域に追加に必要な空きがない場合は、何も追加せずに false を返す。(容量制限による追い出しは反映される)
+      bool store(const String & key, const String & value, uint32_t hash, uint32_t expires_at=0) {
+        // RootNode::store() は渡したrootの参照を解放するので、公開時の参照とは別に参照を一つ増やしておく。
+        // (公開時の参照は retireRoot() で、読み込み用スロットから参照されていないことを確認してから解放する)
+        md_t old = h_->root;
+        bool dupped = alc_.dup(old);
+        assert(dupped);
+        
+        std::string compressed;
+        uint32_t value_flags = 0;
+        const String stored = encode(value, compressed, value_flags);
+        alc_.attachDedupTable(h_->dedup_table); // 他のプロセスで有効にされた場合にも使えるように、毎回共有メモリから読む
+        
+        md_t root = evictIfNeed(old, RootNode::footprint(Stats(1, key.size(), stored.size())));
+        if(! alc_.hasRoom(alc_.ptr<RootNode>(root)->storeBound(key, stored, hash, h_->resize_policy, expires_at, alc_))) {
+          if(root == old) {
+            RootNode::releaseNode(root, alc_); // 上で増やした参照
+            return false;
           }
-          
-          //old = h_->root;
-          h_->root = RootNode::store(root.md(), key, value, alc_);
-          assert(h_->root != 0);
-          break;
+          h_->root = root; // 追い出しの結果は公開する
+          retireRoot(old);
+          notifyChange();
+          return false;
+        }
+        
+        h_->root = RootNode::store(root, key, stored, hash, h_->resize_policy, alc_, expires_at, value_flags);
+        assert(h_->root != 0);
+        touch(hash);
+        retireRoot(old);
+        notifyChange();
+        return true;
+      }
+      
+      // 公開されていない空のテーブルを作って、そのrootを返す。(不要になったら undupRoot() で解放する)
+      md_t createRoot() {
+        md_t root = RootNode::create(h_->resize_policy, alc_);
+        assert(root != 0);
+        return root;
+      }
+
+      // 公開されていないテーブル root に key と value を追加したrootを返す。(root の参照は新しいrootに引き継がれる)
+      md_t store(md_t root, const String & key, const String & value) {
+        std::string compressed;
+        uint32_t value_flags = 0;
+        const String stored = encode(value, compressed, value_flags);
+        alc_.attachDedupTable(h_->dedup_table);
+        return RootNode::store(root, key, stored, key.hash(), h_->resize_policy, alc_, 0, value_flags);
+      }
+
+      // left と right を合わせたテーブルのrootを返す。(どちらも公開されないし、参照も解放されない)
+      md_t merge(md_t left, md_t right, MergePolicy policy) {
+        return RootNode::merge(left, right, policy, h_->resize_policy, alc_);
+      }
+
+      // 公開中のテーブルに root を合わせたものを、一度のroot更新で公開する。
+      // 公開中のテーブルが左側になる。(root の参照は解放されない)
+      void merge(md_t root, MergePolicy policy) {
+        md_t live = dupRoot();
+        h_->root = RootNode::merge(live, root, policy, h_->resize_policy, alc_);
+        retireRoot(live);
+        undupRoot(live);
+        notifyChange();
+      }
+      
+      // 期限切れのエントリを、前回の続きから最大 max_buckets 個のリストについて取り除く。取り除いたエントリの数を返す。
+      // 書き換えたリストがあれば、新しいrootを一度だけ公開する。(書き込み側と同様に呼び出し元で直列化すること)
+      // 取り除いたエントリの領域は、古いrootを参照する読み込み側がいなくなった時点で回収される。(retireRoot()を参照)
+      size_t sweep(uint32_t max_buckets) {
+        md_t old = h_->root;
+        bool dupped = alc_.dup(old); // RootNode::sweep() の作業用の参照
+        assert(dupped);
+
+        Stats removed;
+        md_t root = RootNode::sweep(old, h_->sweep_cursor, max_buckets, Entry::now(), removed, alc_);
+        if(root == old) {
+          RootNode::releaseNode(old, alc_);
+          return 0;
         }
-        //RootNode::releaseNode(old, alc_);
+
+        h_->root = root;
+        retireRoot(old);
+        notifyChange();
+        return removed.count;
       }
       
+      // エントリが占めるバイト数の上限を設定する。(0 なら制限なし。共有メモリに書き込まれるので全プロセスに反映される)
+      // 上限を越える store() は、追加の前に CLOCK で選んだ最近検索されていないエントリを追い出す。
+      // 最初に上限を設定した時に、その上限に見合う大きさの参照ビットの表を作る。(表を作れなかった場合は false を返す)
+      bool setByteBudget(uint64_t bytes) {
+        if(bytes != 0 && h_->clock_table == 0) {
+          atomic::store(&h_->clock_table, ClockTable::create(bytes, alc_));
+        }
+        h_->byte_budget = bytes;
+        return bytes == 0 || h_->clock_table != 0;
+      }
+      uint64_t byteBudget() const { return h_->byte_budget; }
+
+      // threshold バイト以上の値を、同じ内容のもの同士で一つの Blob に共有して格納するようにする。
+      // 表は共有メモリ上に一度だけ作られる。(既に有効な場合は何もしない。slot_count が 0 の場合や表を作れなかった場合は false を返す)
+      bool enableDedup(uint32_t threshold, uint32_t slot_count) {
+        if(h_->dedup_table == 0) {
+          h_->dedup_table = DedupTable::create(slot_count, threshold, alc_);
+        }
+        return h_->dedup_table != 0;
+      }
+
+      // threshold バイト以上の値を codec で圧縮して格納するようにする。(codec が NULL なら圧縮しない)
+      // テーブルに記録されている方式と codec の Codec::id() が異なる場合は、設定せずに false を返す。
+      // NOTE: 圧縮された値を読むには、読み込み側のプロセスでも同じ codec を設定する必要がある
+      bool setValueCodec(const codec::Codec * codec, uint32_t threshold) {
+        if(codec != NULL) {
+          const uint32_t id = codec->id();
+          if(! atomic::compare_and_swap(&h_->codec_id, static_cast<uint32_t>(0), id) && atomic::load(&h_->codec_id) != id) {
+            return false;
+          }
+        }
+        alc_.attachCodec(codec);
+        compress_threshold_ = threshold;
+        return true;
+      }
+      
+      // 大きな値を置く別領域を設定する。(プロセス毎の設定。FixedAllocator::attachColdRegion() を参照)
+      void attachColdRegion(allocator::LogAllocator * region) { alc_.attachColdRegion(region); }
+      
       md_t dupRoot() {
         for(;;) {
           md_t root = h_->root;
@@ -94,9 +253,109 @@ namespace iht {
         RootNode::releaseNode(root, alc_);
       }
 
+      // 空いている読み込み用スロットを確保して、その添字を返す。(空きがない場合は -1)
+      int acquireReaderSlot() {
+        for(uint32_t i=0; i < READER_SLOT_LIMIT; i++) {
+          ReaderSlot & slot = h_->readers[i];
+          if(atomic::load(&slot.in_use) == 0 && atomic::compare_and_swap(policy_, &slot.in_use, 0u, 1u)) {
+            for(;;) {
+              uint32_t count = atomic::load(&h_->reader_slot_count);
+              if(count > i || atomic::compare_and_swap(policy_, &h_->reader_slot_count, count, i+1)) {
+                break;
+              }
+            }
+            return static_cast<int>(i);
+          }
+        }
+        return -1;
+      }
+
+      void releaseReaderSlot(int slot) {
+        if(slot >= 0) {
+          atomic::store(&h_->readers[slot].root, 0u);
+          atomic::store(&h_->readers[slot].in_use, 0u);
+        }
+      }
+
+      // 公開中のrootを参照して返す。
+      // slot が有効ならそこにrootを書き込むだけで、rootの参照カウントは変更しない。(無効なら dupRoot() と同じ)
+      // NOTE: 書き込んだ後にrootが変わっていないことを確認するので、書き込み側の retireRoot() が必ずこの参照に気付く
+      md_t pinRoot(int slot) {
+        if(slot < 0) {
+          return dupRoot();
+        }
+        
+        md_t * place = &h_->readers[slot].root;
+        for(;;) {
+          md_t root = atomic::load(&h_->root);
+          atomic::store(place, root);
+          atomic::fence(policy_);
+          if(atomic::load(&h_->root) == root) {
+            return root;
+          }
+        }
+      }
+
+      void unpinRoot(int slot, md_t root) {
+        if(slot < 0) {
+          undupRoot(root);
+        } else {
+          atomic::store(&h_->readers[slot].root, 0u);
+        }
+      }
+
       // XXX:
       //md_t getRoot() const { return h_->root; }
-      md_t getRoot() const { return atomic::fetch(&h_->root); }
+      md_t getRoot() const { return atomic::fetch(policy_, &h_->root); }
+
+      // 読み込みのみで済ませる (読み込み側が頻繁に呼び出すので、共有キャッシュラインへの書き込みを避ける)
+      uint32_t getGeneration() const { return atomic::load(&h_->generation); }
+
+      // rootの世代が known から変化するまで待機する。
+      // 変化した場合は true を、timeout_us(マイクロ秒)が経過した場合は false を返す。
+      // timeout_us が負の場合は無期限に待機する。
+      bool waitForChange(uint32_t known, long timeout_us) const {
+        if(getGeneration() != known) {
+          return true;
+        }
+
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec  += timeout_us / 1000000;
+        deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+        if(deadline.tv_nsec >= 1000000000) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+
+        atomic::add(&h_->waiters, 1);
+        bool changed = false;
+        for(;;) {
+          if(getGeneration() != known) {
+            changed = true;
+            break;
+          }
+
+          if(timeout_us < 0) {
+            ipc::futex::wait(&h_->generation, known, NULL);
+            continue;
+          }
+
+          timespec now;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          timespec rest = {deadline.tv_sec - now.tv_sec, deadline.tv_nsec - now.tv_nsec};
+          if(rest.tv_nsec < 0) {
+            rest.tv_sec--;
+            rest.tv_nsec += 1000000000;
+          }
+          if(rest.tv_sec < 0) {
+            break; // timeout
+          }
+          ipc::futex::wait(&h_->generation, known, &rest);
+        }
+        atomic::sub(&h_->waiters, 1);
+        return changed;
+      }
 
       bool isMember(const String & key) const {
         return false;
@@ -106,29 +365,251 @@ namespace iht {
         return alc_.ptr<RootNode>(root)->count();
       }
 
+      size_t buckets(md_t root) const {
+        return alc_.ptr<RootNode>(root)->buckets(alc_);
+      }
+
+      // 期限切れのエントリは含まない
+      Stats stats(md_t root) const {
+        return alc_.ptr<RootNode>(root)->liveStats(Entry::now(), alc_);
+      }
+
+      Stats stats(md_t root, uint32_t prefix, uint32_t level) const {
+        return alc_.ptr<RootNode>(root)->liveStats(prefix, level, Entry::now(), alc_);
+      }
+
       size_t size() {
-        for(;;) {
-          Ref<RootNode> root(h_->root, alc_);
-          if(root) {
-            // TODO: releaseNodeが必要 (undupに成功したなら)
-            return root.ptr()->count();
+        md_t root = dupRoot();
+        const size_t count = size(root);
+        undupRoot(root);
+        return count;
+      }
+
+      // key に対応する値を返す。
+      // Blob に分割格納されている大きな値は buf に連結した上で、圧縮されている値は buf に伸長して返す。(それ以外の値はコピーされない)
+      String find(md_t root, const String & key, std::string & buf) const {
+        return find(root, key, key.hash(), buf);
+      }
+
+      // hash は key のハッシュ値。(store() の時と同じハッシュ関数で求めたもの)
+      String find(md_t root, const String & key, uint32_t hash, std::string & buf) const {
+        const Entry * e = live(alc_.ptr<RootNode>(root)->find(key, hash, alc_));
+        if(e == NULL) {
+          return String::invalid();
+        }
+        touch(hash);
+        return e->value(buf, alc_);
+      }
+
+      // cache を使う以外は find() と同じ。generation は root の世代。
+      // キャッシュに見つからなかった場合は通常通りに検索し、見つかったエントリをキャッシュに追加する。
+      String find(md_t root, const String & key, std::string & buf, FindCache & cache, uint32_t generation) const {
+        return find(root, key, key.hash(), buf, cache, generation);
+      }
+
+      String find(md_t root, const String & key, uint32_t hash, std::string & buf, FindCache & cache, uint32_t generation) const {
+        const Entry * e = cache.find(key, hash, generation);
+        if(e == NULL) {
+          e = alc_.ptr<RootNode>(root)->find(key, hash, alc_);
+          if(e == NULL) {
+            return String::invalid();
           }
+          cache.put(hash, generation, e);
         }
+        if(live(e) == NULL) {
+          return String::invalid();
+        }
+        touch(hash);
+        return e->value(buf, alc_);
       }
 
-      String find(md_t root, const String & key) const {
-        return alc_.ptr<RootNode>(root)->find(key, alc_);
+      // find() を count 回呼び出すのと同じ。(hashes は各キーのハッシュ値。NULL の場合は String::hash() で求める)
+      // Blob に格納されている値や圧縮されている値は bufs に連結(伸長)する。(bufs は連結が必要な値の数にリサイズされる)
+      void findMany(md_t root, const String * keys, const uint32_t * hashes, String * results, uint32_t count,
+                    std::vector<std::string> & bufs) const {
+        if(count == 0) {
+          return;
+        }
+        std::vector<const Entry*> entries(count);
+        alc_.ptr<RootNode>(root)->findMany(keys, hashes, &entries[0], count, alc_);
+
+        uint32_t blob_count = 0;
+        for(uint32_t i=0; i < count; i++) {
+          entries[i] = live(entries[i]);
+          if(entries[i] != NULL) {
+            touch(entries[i]->hash);
+            if(entries[i]->needsBuffer()) {
+              blob_count++;
+            }
+          }
+        }
+        bufs.resize(blob_count);
+
+        std::string unused; // Blobでも圧縮されてもいない値は連結しないので、バッファは使われない
+        for(uint32_t i=0, j=0; i < count; i++) {
+          if(entries[i] == NULL) {
+            results[i] = String::invalid();
+          } else if(entries[i]->needsBuffer()) {
+            results[i] = entries[i]->value(bufs[j++], alc_);
+          } else {
+            results[i] = entries[i]->value(unused, alc_);
+          }
+        }
+      }
+
+      // key に対応する値の offset バイト目から最大 size バイトを buf に格納する。
+      // Blob に格納されている値は、範囲に含まれるチャンクのみを読み込む。(値を読めない場合も false を返す。Entry::value()を参照)
+      bool read(md_t root, const String & key, uint32_t offset, uint32_t size, std::string & buf) const {
+        const Entry * e = live(alc_.ptr<RootNode>(root)->find(key, alc_));
+        if(e == NULL) {
+          return false;
+        }
+        touch(e->hash);
+        return e->read(offset, size, buf, alc_);
       }
 
+      // prefix で始まるキーのエントリを、キーの辞書順に callback(key, value) に渡す。
+      // テーブルが索引(ResizePolicy::ordered_index)を持たない場合は何もせずに false を返す。
+      // 索引を辿るので、コストは列挙するエントリの数(と索引の深さ)に比例する。
       template <class Callback>
-      void foreach(Callback & callback) {
-        for(;;) {
-          Ref<RootNode> root(h_->root, alc_);
-          if(! root) {
-            continue;
+      bool scanPrefix(md_t root, const String & prefix, Callback & callback) const {
+        if(! h_->resize_policy.ordered_index) {
+          return false;
+        }
+        IndexVisitor<Callback> visitor(alc_.ptr<RootNode>(root), callback, alc_);
+        alc_.ptr<RootNode>(root)->scanPrefix(prefix, visitor, alc_);
+        return true;
+      }
+
+      // begin 以上 end 未満のキーのエントリを、キーの辞書順に callback(key, value) に渡す。(end が String::invalid() なら上限なし)
+      template <class Callback>
+      bool scanRange(md_t root, const String & begin, const String & end, Callback & callback) const {
+        if(! h_->resize_policy.ordered_index) {
+          return false;
+        }
+        IndexVisitor<Callback> visitor(alc_.ptr<RootNode>(root), callback, alc_);
+        alc_.ptr<RootNode>(root)->scanRange(begin, end, visitor, alc_);
+        return true;
+      }
+
+      // root のテーブルを FrozenTable の形式で filepath に書き出す。(期限切れのエントリは含めない)
+      // 値は圧縮や Blob への分割を解いた形で書き出すので、読み込み側は codec などの設定なしに参照できる。
+      bool freeze(md_t root, const std::string & filepath, mode_t mode) const {
+        const RootNode * node = alc_.ptr<RootNode>(root);
+        FrozenTable::Builder builder(filepath, node->count(), mode);
+        if(! builder) {
+          return false;
+        }
+        
+        Freezer freezer(builder, alc_);
+        node->eachEntry(freezer, alc_);
+        return ! freezer.failed && builder.commit(); // commit() しなければ一時ファイルは消される
+      }
+
+      // root のテーブルを dump の形式で fd に書き出す。(期限切れのエントリは含めない)
+      // エントリは RootNode::trieOrder() の順に、値は圧縮や Blob への分割を解いた形で書き出す。
+      bool dump(md_t root, int fd) const {
+        const RootNode * node = alc_.ptr<RootNode>(root);
+        dump::Writer writer(fd, node->count());
+        Dumper dumper(writer, alc_);
+        node->eachEntryInOrder(dumper, alc_);
+        return ! dumper.failed && writer.finish();
+      }
+
+      // filepath に書き出す。(一時ファイル(filepath + ".tmp")に書いてから置き換える)
+      bool dump(md_t root, const std::string & filepath, mode_t mode) const {
+        const std::string tmppath = filepath + ".tmp";
+        int fd = open(tmppath.c_str(), O_CREAT|O_TRUNC|O_WRONLY, mode);
+        if(fd == -1) {
+          return false;
+        }
+
+        bool ok = dump(root, fd) && fsync(fd) == 0;
+        close(fd);
+        if(! ok || rename(tmppath.c_str(), filepath.c_str()) != 0) {
+          unlink(tmppath.c_str());
+          return false;
+        }
+        return true;
+      }
+
+      // dump の形式のテーブルを fd から読み込み、公開中のテーブルに合わせたものを一度のroot更新で公開する。
+      // 読み込んだエントリからは RootNode::build() で新しいrootを組み立てるので、キー毎に store() するより速い。
+      // 両方に存在するキーは policy に従って選ぶ。期限切れのエントリは読み飛ばす。
+      // dump 内で同じキーが複数回現れる場合は、後のものを使う。(RootNode::build() を参照)
+      // 読み込みに失敗した場合(途中で切れている場合や、終端のエントリ数が合わない場合を含む)は何も公開せずに false を返す。
+      // NOTE: merge() と同様に書き込み操作なので、他の書き込みとは直列化すること
+      bool restore(int fd, MergePolicy policy) {
+        dump::Reader reader(fd);
+        if(! reader) {
+          return false;
+        }
+
+        alc_.attachDedupTable(h_->dedup_table);
+        DumpSource source(reader, *this);
+        md_t root = RootNode::build(source, reader.countHint(), h_->resize_policy, alc_);
+        if(root == 0 || ! reader.completed()) {
+          if(root != 0) {
+            undupRoot(root);
           }
-          foreach(root, callback, alc_);
+          return false;
         }
+
+        merge(root, policy);
+        undupRoot(root);
+        return true;
+      }
+
+      bool restore(const std::string & filepath, MergePolicy policy) {
+        int fd = open(filepath.c_str(), O_RDONLY);
+        if(fd == -1) {
+          return false;
+        }
+        bool ok = restore(fd, policy);
+        close(fd);
+        return ok;
+      }
+
+      // 一様ランダムに選んだ count 個のエントリ(重複あり)を callback(key, value) に渡す。(期限切れのエントリは選ばない)
+      // rng() は一様分布の uint32_t 値を返す乱数生成器。
+      template <class Random, class Callback>
+      void sample(md_t root, uint32_t count, Random & rng, Callback & callback) const {
+        const RootNode * node = alc_.ptr<RootNode>(root);
+        const uint32_t now = Entry::now();
+        if(node->liveStats(now, alc_).count == 0) {
+          return;
+        }
+
+        std::string buf;
+        for(uint32_t i=0; i < count; i++) {
+          const Entry * e = randomLiveEntry(node, now, rng);
+          callback(e->key(), e->value(buf, alc_));
+        }
+      }
+
+      // count 個のサンプルから統計量を推定する。(値を読み込まずに、キーと値のサイズのみを参照する)
+      // sample() と同様に期限切れのエントリは選ばず、母数にも含めない。
+      template <class Random>
+      void sketch(md_t root, uint32_t count, Random & rng, Sketch & sketch) const {
+        const RootNode * node = alc_.ptr<RootNode>(root);
+        const uint32_t now = Entry::now();
+        const uint64_t population = node->liveStats(now, alc_).count;
+        sketch.setPopulation(population);
+        if(population == 0) {
+          return;
+        }
+
+        for(uint32_t i=0; i < count; i++) {
+          const Entry * e = randomLiveEntry(node, now, rng);
+          sketch.add(e->key_size, e->val_size);
+        }
+      }
+
+      template <class Callback>
+      void foreach(Callback & callback) {
+        md_t root = dupRoot();
+        foreach(root, callback);
+        undupRoot(root);
       }
       
       template <class Callback>
@@ -136,10 +617,226 @@ namespace iht {
         RootNode::foreach(root, callback, alc_);
       }
 
+    private:
+      // 公開を終えたroot(公開時の参照)を解放する。
+      // 読み込み用スロットから参照されている間は解放を遅らせ、以降の retireRoot() の呼び出し時に改めて確認する。
+      // 保留するrootの数に上限はない。(各スロットが参照するrootは一つなので、保留され続けるのは高々スロット数分)
+      // 解放すると、他のrootと共有していない部分木(上書きや削除で見えなくなったリストとエントリ)の領域も回収される。
+      // (dupRoot() による参照は従来通り参照カウントで管理されるので、ここでは考慮しなくて良い)
+      // NOTE: 書き込み側は呼び出し元で直列化されている前提
+      void retireRoot(md_t old) {
+        atomic::fence(policy_); // 新しいrootの公開をスロットの走査より先に行う
+        
+        const uint32_t slot_count = atomic::load(&h_->reader_slot_count);
+        alc_.ptr<RootNode>(old)->setRetiredNext(h_->retired);
+
+        md_t kept = 0; // 保留し続けるrootのリストの先頭と末尾
+        md_t last = 0;
+        for(md_t root = old; root != 0;) {
+          RootNode * node = alc_.ptr<RootNode>(root);
+          const md_t next = node->retiredNext();
+          if(isPinned(root, slot_count)) {
+            node->setRetiredNext(0);
+            if(last == 0) {
+              kept = root;
+            } else {
+              alc_.ptr<RootNode>(last)->setRetiredNext(root);
+            }
+            last = root;
+          } else {
+            RootNode::releaseNode(root, alc_);
+          }
+          root = next;
+        }
+        h_->retired = kept;
+      }
+
+      // 容量制限を越える場合は、incoming バイト分の空きができるまでエントリを追い出したrootを返す。
+      // (root の参照は返り値に引き継がれる)
+      md_t evictIfNeed(md_t root, uint64_t incoming) {
+        const uint64_t budget = h_->byte_budget;
+        if(budget == 0) {
+          return root;
+        }
+        
+        const uint64_t used = RootNode::footprint(alc_.ptr<RootNode>(root)->stats(alc_));
+        if(used + incoming <= budget) {
+          return root;
+        }
+        
+        Stats removed;
+        return RootNode::evict(root, h_->clock_cursor, used + incoming - budget, Entry::now(), clockTable(), removed, alc_);
+      }
+
+      ClockTable * clockTable() const {
+        const md_t md = atomic::load(&h_->clock_table);
+        return md != 0 ? alc_.ptr<ClockTable>(md) : NULL;
+      }
+
+      // 容量制限がある場合は、hash のエントリが追加(検索)されたことを参照ビットの表に記録する
+      void touch(uint32_t hash) const {
+        ClockTable * clock = clockTable();
+        if(clock != NULL) {
+          clock->touch(hash);
+        }
+      }
+
+      // 索引から列挙したキーのエントリを引いて、その値と共に callback に渡す。(期限切れのエントリは飛ばす)
+      template <class Callback>
+      struct IndexVisitor {
+        IndexVisitor(const RootNode * node, Callback & callback, const allocator::FixedAllocator & alc)
+          : node(node), callback(callback), alc(alc) {}
+
+        void operator()(const String & key, uint32_t hash) {
+          const Entry * e = live(node->find(key, hash, alc));
+          if(e != NULL) {
+            callback(e->key(), e->value(buf, alc));
+          }
+        }
+
+        const RootNode * node;
+        Callback & callback;
+        const allocator::FixedAllocator & alc;
+        std::string buf;
+      };
+
+      // 値を読めないエントリ(Entry::value() を参照)があった場合は failed を立てる。(書き出しは失敗として扱う)
+      struct Freezer {
+        Freezer(FrozenTable::Builder & builder, const allocator::FixedAllocator & alc) : builder(builder), alc(alc), failed(false) {}
+
+        void operator()(const Entry & e) {
+          const Entry * body = live(e.body(alc));
+          if(body == NULL || failed) {
+            return;
+          }
+          const String value = body->value(buf, alc);
+          if(value.data() == String::invalid().data()) {
+            failed = true;
+            return;
+          }
+          builder.add(body->key(), value, e.hash);
+        }
+
+        FrozenTable::Builder & builder;
+        const allocator::FixedAllocator & alc;
+        std::string buf;
+        bool failed;
+      };
+
+      struct Dumper {
+        Dumper(dump::Writer & writer, const allocator::FixedAllocator & alc) : writer(writer), alc(alc), failed(false) {}
+
+        void operator()(const Entry & e) {
+          const Entry * body = live(e.body(alc));
+          if(body == NULL || failed) {
+            return;
+          }
+          const String value = body->value(buf, alc);
+          if(value.data() == String::invalid().data()) {
+            failed = true;
+            return;
+          }
+          writer.add(body->key(), value, e.hash, body->hasExpiry() ? body->expiresAt() : 0);
+        }
+
+        dump::Writer & writer;
+        const allocator::FixedAllocator & alc;
+        std::string buf;
+        bool failed;
+      };
+
+      // dump::Reader から読んだエントリを、格納する形式にして RootNode::build() に渡す
+      class DumpSource {
+      public:
+        DumpSource(dump::Reader & reader, const HashTrieImpl & impl)
+          : reader_(reader), impl_(impl), now_(Entry::now()), empty_(false)
+        {
+          pop();
+        }
+
+        bool empty() const { return empty_; }
+        const BulkEntry & front() const { return entry_; }
+
+        void pop() {
+          String value;
+          do {
+            if(! reader_.next(entry_.key, value, entry_.hash, entry_.expires_at)) {
+              empty_ = true;
+              return;
+            }
+          } while(entry_.expires_at != 0 && entry_.expires_at <= now_);
+
+          entry_.value_flags = 0;
+          entry_.value = impl_.encode(value, buf_, entry_.value_flags);
+        }
+
+      private:
+        dump::Reader & reader_;
+        const HashTrieImpl & impl_;
+        const uint32_t now_;
+        BulkEntry entry_;
+        std::string buf_;
+        bool empty_;
+      };
+
+      // 格納する形式の値を返す。圧縮する場合は buf に圧縮した上で value_flags に Entry::COMPRESSED を設定する。
+      String encode(const String & value, std::string & buf, uint32_t & value_flags) const {
+        if(alc_.codec() == NULL || value.size() < compress_threshold_ || ! alc_.codec()->compress(value, buf)) {
+          return value;
+        }
+        value_flags |= Entry::COMPRESSED;
+        return String(buf);
+      }
+
+      // 期限切れのエントリ(本体)は存在しないものとして NULL を返す。(リストからは store() や sweep() の際に取り除かれる)
+      static const Entry * live(const Entry * e) {
+        return e != NULL && e->hasExpiry() && e->expiresAt() <= Entry::now() ? NULL : e;
+      }
+
+      bool isPinned(md_t root, uint32_t slot_count) const {
+        for(uint32_t i=0; i < slot_count; i++) {
+          if(atomic::load(&h_->readers[i].root) == root) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      // 時刻 now の時点で期限切れでないエントリ(本体)を一様ランダムに選んで返す。(そのようなエントリが一つはあること)
+      // 取り除かれるまでの期限切れのエントリも数に含めて選び、それを引いた場合は引き直す。
+      template <class Random>
+      const Entry * randomLiveEntry(const RootNode * node, uint32_t now, Random & rng) const {
+        const uint64_t population = node->stats(alc_).count;
+        for(;;) {
+          const Entry * e = node->entryAt(randomIndex(rng, population), alc_);
+          if(! e->isExpired(now, alc_)) {
+            return e;
+          }
+        }
+      }
+
+      // [0, population) の範囲の一様乱数を返す
+      template <class Random>
+      static uint64_t randomIndex(Random & rng, uint64_t population) {
+        uint64_t r = (static_cast<uint64_t>(static_cast<uint32_t>(rng())) << 32) | static_cast<uint32_t>(rng());
+        return r % population;
+      }
+
+      // 新しいrootの公開を(全プロセスの)待機者に通知する
+      void notifyChange() {
+        atomic::add(policy_, &h_->generation, 1);
+        if(atomic::fetch(policy_, &h_->waiters) != 0) {
+          ipc::futex::wake(&h_->generation, INT_MAX);
+        }
+      }
+
     private:
       const size_t shm_size_;
+      const ResizePolicy resize_policy_; // 初期化時に共有メモリに書き込まれる (既存のテーブルには反映されない)
+      const atomic::Policy policy_;      // このプロセス内でのみ有効 (共有メモリには書き込まれない)
       Header * h_;
       allocator::FixedAllocator alc_;
+      uint32_t compress_threshold_;      // このプロセス内でのみ有効
     };
   }
 }
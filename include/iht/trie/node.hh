@@ -2,10 +2,19 @@
 #define __IHT_TRIE_NODE_HH__
 
 #include "ref.hh"
+#include "blob.hh"
+#include "dedup_table.hh"
+#include "clock_table.hh"
+#include "ordered_index.hh"
+#include "bloom_filter.hh"
 #include "../allocator/fixed_allocator.hh"
 #include "../string.hh"
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <algorithm>
 
 // TODO:
 #include <iostream>
@@ -41,26 +50,431 @@ private:
 };
 
   namespace trie {
+    // 部分木に含まれるエントリの集計値
+    struct Stats {
+      Stats() : count(0), key_bytes(0), value_bytes(0), expiring(0) {}
+      Stats(uint64_t count, uint64_t key_bytes, uint64_t value_bytes, uint64_t expiring=0)
+        : count(count), key_bytes(key_bytes), value_bytes(value_bytes), expiring(expiring) {}
+      
+      void add(const Stats & s) {
+        count += s.count;
+        key_bytes += s.key_bytes;
+        value_bytes += s.value_bytes;
+        expiring += s.expiring;
+      }
+
+      void sub(const Stats & s) {
+        count -= s.count;
+        key_bytes -= s.key_bytes;
+        value_bytes -= s.value_bytes;
+        expiring -= s.expiring;
+      }
+      
+      uint64_t count;
+      uint64_t key_bytes;
+      uint64_t value_bytes;
+      uint64_t expiring; // 有効期限を持つエントリの数 (0 なら期限切れのエントリを探す必要がない)
+    };
+
+    // 一回の更新で追加/削除されたエントリの集計値。
+    // 更新対象のリストからルートまでの経路上の各ノードの Stats に反映される。
+    // (removed には上書きされたエントリの他に、書き換えの際に捨てられた期限切れのエントリも含まれる)
+    struct Change {
+      Change(uint32_t now=0, uint32_t expires_at=0, uint32_t value_flags=0)
+        : buckets(0), dropped(NULL), now(now), expires_at(expires_at), value_flags(value_flags) {}
+      
+      Stats added;
+      Stats removed;
+      uint32_t buckets; // リストの分割によって増えたリストの数
+      std::vector<String> * dropped; // NULL でなければ、(上書きではなく)期限切れや追い出しで取り除いたエントリのキーを集める
+
+      // 以下は更新の入力
+      uint32_t now;        // 現在時刻 (0 でなければ、書き換えるリスト内の期限切れのエントリを捨てる)
+      uint32_t expires_at; // 追加するエントリの有効期限 (0 なら期限なし)
+      uint32_t value_flags; // 追加するエントリの値の形式 (Entry::COMPRESSED)
+    };
+
+    // RootNode::build() の入力となるエントリ。(value は格納する形式のもので、value_flags はその形式)
+    struct BulkEntry {
+      String key;
+      String value;
+      uint32_t hash;
+      uint32_t expires_at;
+      uint32_t value_flags;
+    };
+
+    // リスト(バケット)の分割方針。リストの長さはエントリ数で数える。
+    // 挿入後のリストの長さが max_chain を越えた場合、
+    // またはテーブル全体の平均リスト長が average_chain を越えていて、かつ挿入後のリストの長さも average_chain を越えた場合に、
+    // そのリストを一段深いノード(16個のリスト)に分割する。
+    //
+    // directory_bits は、ルートが持つ直接索引のディレクトリのビット数。(4 または 8。4 の場合はノード一段分と同じ)
+    // 8 にすると大きなテーブルで検索時に辿るノードが一段減るが、更新毎にディレクトリ(1KB)をコピーすることになる。
+    //
+    // filter_bits_per_key が 0 でない場合は、rootにキーあたりそのビット数のBloomフィルタを持たせて、存在しないキーの検索を早期に打ち切る。
+    // (10 で偽陽性率は約1%。フィルタはエントリ数が容量を越える度に倍の容量で作り直される)
+    //
+    // ordered_index が true の場合は、rootにキーを辞書順に並べた索引(OrderedIndex)も持たせて、前方一致や範囲での列挙を可能にする。
+    // (更新毎に索引の経路もコピーされるので、その分だけ書き込みが遅くなる)
+    struct ResizePolicy {
+      ResizePolicy(uint32_t average_chain=4, uint32_t max_chain=16, uint32_t directory_bits=4, uint32_t filter_bits_per_key=0,
+                   bool ordered_index=false)
+        : average_chain(average_chain), max_chain(max_chain), directory_bits(directory_bits),
+          filter_bits_per_key(filter_bits_per_key), ordered_index(ordered_index) {}
+      
+      uint32_t average_chain;
+      uint32_t max_chain;
+      uint32_t directory_bits;
+      uint32_t filter_bits_per_key;
+      bool ordered_index;
+    };
+    
+    // merge() で同じキーが両側に存在する場合に、どちらの値を残すか
+    enum MergePolicy {
+      PREFER_LEFT,  // 一つ目のテーブルの値を残す
+      PREFER_RIGHT  // 二つ目のテーブルの値を残す
+    };
+
+    // バケット内の一エントリ(キーと値)。Cons の中に詰めて配置される。
+    // キーのハッシュ値も保持しているので、探索時のキー比較やリサイズ時の再配置でハッシュ値を計算し直す必要がない。
+    //
+    // INLINE_LIMIT を越える大きなエントリは、キーと値を別ブロック(レコード)に置いて Cons にはその記述子のみを持たせる。
+    // レコードは不変かつ参照カウントで共有されるので、セルのコピー(更新やリサイズ時)ではキーと値ではなく記述子のみがコピーされる。
+    //
+    // また Blob::CHUNK_SIZE を越える値は Blob としてチャンク分割して格納し、エントリ本体には値の代わりに Blob の記述子を持たせる。
+    struct Entry {
+      typedef uint32_t md_t;
+      typedef allocator::FixedAllocator Alc;
+
+      static const uint32_t INLINE_LIMIT = 64;
+
+      enum FLAG {
+        REF     = 1, // data には(キーと値の代わりに)レコードの記述子が格納されている
+        BLOB    = 2, // data にはキーと(値の代わりに)Blobの記述子が格納されている。val_size は値の実際のサイズ
+        EXPIRES = 4, // 値の直後に有効期限(time(NULL)基準の秒)を持つ。(REF の場合はレコードが有効期限を持つ)
+
+        // NOTE: 8 は使わない (CLOCK の参照ビットはエントリではなく ClockTable に持たせる)
+
+        // 値は FixedAllocator::coldRegion() に置かれていて、data にはキーと(値の代わりに)そのオフセット(64bit)が格納されている
+        SPILLED = 16,
+
+        // 値は alc.codec() で圧縮されている。val_size は圧縮後のサイズ (圧縮後の値が上の各形式で格納される)
+        COMPRESSED = 32
+      };
+      
+      uint32_t hash;
+      uint32_t key_size:24;
+      uint32_t flags:8;
+      uint32_t val_size;
+      char data[0];
+
+      bool isRef() const { return flags & REF; }
+      bool isBlob() const { return flags & BLOB; }
+      bool isSpilled() const { return flags & SPILLED; }
+      bool isCompressed() const { return flags & COMPRESSED; }
+
+      // 値を返すのに buf への連結(または伸長)が必要かどうか
+      bool needsBuffer() const { return isBlob() || isCompressed(); }
+      bool hasExpiry() const { return flags & EXPIRES; }
+      Stats stats() const { return Stats(1, key_size, val_size, hasExpiry() ? 1 : 0); }
+      md_t ref() const { return *reinterpret_cast<const md_t*>(data); }
+      md_t blob() const {
+        md_t md; // キーの直後に置かれるので4バイト境界に揃っているとは限らない
+        memcpy(&md, data+key_size, sizeof(md_t));
+        return md;
+      }
+      uint64_t spilled() const {
+        uint64_t offset;
+        memcpy(&offset, data+key_size, sizeof(uint64_t));
+        return offset;
+      }
+      
+      // 有効期限を返す。(期限がない場合は 0。REF のエントリでは body() に対して呼び出すこと)
+      uint32_t expiresAt() const {
+        if(! hasExpiry()) {
+          return 0;
+        }
+        uint32_t t; // 値の直後に置かれるので4バイト境界に揃っているとは限らない
+        memcpy(&t, data+key_size+storedValueSize(), sizeof(uint32_t));
+        return t;
+      }
+
+      // 時刻 now の時点で期限切れかどうか (REF のエントリでも良い)
+      bool isExpired(uint32_t now, const Alc & alc) const {
+        return hasExpiry() && body(alc)->expiresAt() <= now;
+      }
+
+      // 有効期限の基準となる現在時刻 (プロセス間で共通の時計を使う)
+      static uint32_t now() { return static_cast<uint32_t>(time(NULL)); }
+
+      // キーと値を実際に保持しているエントリを返す
+      const Entry * body(const Alc & alc) const { return isRef() ? alc.ptr<Entry>(ref()) : this; }
+
+      String key() const { return String(data, key_size); }
+
+      // 値を返す。(Blob に格納されている値は buf に連結して、圧縮されている値は buf に伸長して返す)
+      // 別領域に置かれた値で、その領域が設定されていない(または値が領域の範囲外の)場合は String::invalid() を返す。
+      // 圧縮された値で、codec が設定されていないか伸長に失敗した場合も同様。
+      String value(std::string & buf, const Alc & alc) const {
+        if(isSpilled() && spilledValue(alc) == NULL) {
+          return String::invalid();
+        }
+        if(isCompressed()) {
+          std::string stored_buf;
+          if(alc.codec() == NULL || ! alc.codec()->decompress(storedValue(stored_buf, alc), buf)) {
+            return String::invalid();
+          }
+          return String(buf);
+        }
+        return storedValue(buf, alc);
+      }
+
+      // 値の offset バイト目から最大 size バイトを buf に格納する。(値を読めない場合は false を返す。value() を参照)
+      bool read(uint32_t offset, uint32_t size, std::string & buf, const Alc & alc) const {
+        buf.clear();
+        if(isSpilled() && spilledValue(alc) == NULL) {
+          return false;
+        }
+        if(isCompressed()) {
+          std::string whole;
+          String v = value(whole, alc);
+          if(v.data() == String::invalid().data()) {
+            return false;
+          }
+          if(offset < v.size()) {
+            buf.assign(v.data()+offset, size < v.size()-offset ? size : v.size()-offset);
+          }
+        } else if(isBlob()) {
+          alc.ptr<Blob>(blob())->read(offset, size, buf, alc);
+        } else if(offset < val_size) {
+          const char * v = isSpilled() ? spilledValue(alc) : data+key_size;
+          buf.assign(v+offset, size < val_size-offset ? size : val_size-offset);
+        }
+        return true;
+      }
+
+    private:
+      // 境界に揃っているとは限らない位置から整数を読む
+      template <class T>
+      static T load(const char * p) {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        return v;
+      }
+
+      // 別領域に置かれた値の先頭を返す。(領域が設定されていないか、値が領域の範囲外の場合は NULL)
+      const char * spilledValue(const Alc & alc) const {
+        const allocator::LogAllocator * region = alc.coldRegion();
+        if(region == NULL || ! region->contains(spilled(), val_size)) {
+          return NULL;
+        }
+        return region->ptr<char>(spilled());
+      }
+
+      // 格納されている形式のままの値を返す。(複数のチャンクに分かれた Blob の値は buf に連結して返す)
+      // 別領域に置かれた値は、その領域を直接参照する。(ページは読み込まれた時点でページキャッシュに載る)
+      String storedValue(std::string & buf, const Alc & alc) const {
+        if(isSpilled()) {
+          return String(spilledValue(alc), val_size);
+        }
+        if(! isBlob()) {
+          return String(data+key_size, val_size);
+        }
+        
+        const Blob * b = alc.ptr<Blob>(blob());
+        if(b->contiguous(alc) != NULL) {
+          return String(b->contiguous(alc), val_size);
+        }
+        buf.clear();
+        b->read(0, val_size, buf, alc);
+        return String(buf);
+      }
+
+    public:
+      bool match(const String & k, uint32_t h, const Alc & alc) const {
+        return hash == h && key_size == k.size() && body(alc)->keyEquals(k);
+      }
+
+      // キーが k と等しいかどうか。(REF のエントリでは body() に対して呼び出すこと)
+      // 8バイトと4バイトのキー(TypedHashTrie の整数キーなど)は、memcmp を呼ばずに一回の整数比較で比べる。
+      bool keyEquals(const String & k) const {
+        if(key_size != k.size()) {
+          return false;
+        }
+        switch(key_size) {
+        case sizeof(uint64_t): return load<uint64_t>(data) == load<uint64_t>(k.data());
+        case sizeof(uint32_t): return load<uint32_t>(data) == load<uint32_t>(k.data());
+        default:               return key() == k;
+        }
+      }
+      
+      uint32_t size() const { return isRef() ? refSize() : sizeOf(key_size, storedValueSize() + expirySize()); }
+
+      // エントリ本体に格納されている値部分のバイト数
+      uint32_t storedValueSize() const { return isBlob() ? sizeof(md_t) : isSpilled() ? sizeof(uint64_t) : val_size; }
+
+      // 後続のエントリが4バイト境界に揃うようにサイズを切り上げる
+      static uint32_t sizeOf(uint32_t key_size, uint32_t val_size) {
+        return (sizeof(Entry) + key_size + val_size + 3) & ~3;
+      }
+
+      // key と value を格納するエントリの Cons 内でのサイズ
+      static uint32_t sizeIn(const String & key, const String & value, uint32_t expires_at, const Alc & alc) {
+        uint32_t size = sizeOf(key.size(), storedSizeOf(value, alc) + (expires_at != 0 ? sizeof(uint32_t) : 0));
+        return size > INLINE_LIMIT ? refSize() : size;
+      }
+
+      // init() がレコードや Blob のために割り当てるバイト数の上限 (別領域に置く値の分は含まない)
+      static uint64_t initBound(const String & key, const String & value, uint32_t expires_at, const Alc & alc) {
+        uint64_t bound = 0;
+        if(! spills(value, alc) && blobs(value, alc)) {
+          bound += Blob::sizeBound(value.size());
+        }
+        const uint32_t size = sizeOf(key.size(), storedSizeOf(value, alc) + (expires_at != 0 ? sizeof(uint32_t) : 0));
+        if(size > INLINE_LIMIT) {
+          bound += Alc::blockSize(size);
+        }
+        return bound;
+      }
+
+      // 値を別領域に置くかどうか (書き込み側は直列化されているので、sizeIn() と init() で判定が変わることはない)
+      static bool spills(const String & value, const Alc & alc) {
+        return alc.coldRegion() != NULL && alc.coldRegion()->accepts(value.size());
+      }
+
+      // 値を Blob として格納するかどうか (大きな値と、共有の対象となる値)
+      static bool blobs(const String & value, const Alc & alc) {
+        return value.size() > Blob::CHUNK_SIZE ||
+               (alc.dedupTable() != 0 && value.size() >= alc.ptr<DedupTable>(alc.dedupTable())->threshold());
+      }
+
+      // place にエントリを書き込む。
+      // 大きな値の場合は Blob を、大きなエントリの場合はレコードを割り当てて、その記述子を書き込む。
+      // expires_at が 0 でない場合は、それを有効期限として持たせる。
+      // value_flags は値の形式 (圧縮済みの値なら COMPRESSED。value は圧縮後のもの)
+      static void init(char * place, const String & key, const String & value, uint32_t hash, Alc & alc, uint32_t expires_at=0,
+                       uint32_t value_flags=0) {
+        uint32_t flags = (expires_at != 0 ? EXPIRES : 0) | value_flags;
+        String stored = value;
+        md_t blob;
+        uint64_t offset;
+        if(spills(value, alc)) {
+          offset = alc.coldRegion()->allocate(value.size());
+          assert(offset != 0);
+          memcpy(alc.coldRegion()->ptr<char>(offset), value.data(), value.size());
+          stored = String(reinterpret_cast<const char*>(&offset), sizeof(uint64_t));
+          flags |= SPILLED;
+        } else if(blobs(value, alc)) {
+          blob = alc.dedupTable() != 0 ? alc.ptr<DedupTable>(alc.dedupTable())->intern(value, alc) : Blob::create(alc, value);
+          stored = String(reinterpret_cast<const char*>(&blob), sizeof(md_t));
+          flags |= BLOB;
+        }
+        
+        uint32_t size = sizeOf(key.size(), stored.size() + (expires_at != 0 ? sizeof(uint32_t) : 0));
+        if(size <= INLINE_LIMIT) {
+          initInline(place, key, stored, value.size(), hash, flags, expires_at);
+          return;
+        }
+
+        md_t record = alc.allocate(size);
+        assert(record != 0);
+        initInline(alc.ptr<char>(record), key, stored, value.size(), hash, flags, expires_at);
+
+        // EXPIRES はレコードを辿らずに期限の有無を判定するための目印としても付けておく
+        Entry * e = reinterpret_cast<Entry*>(place);
+        e->hash = hash;
+        e->key_size = key.size();
+        e->flags = REF | (flags & EXPIRES);
+        e->val_size = value.size();
+        *reinterpret_cast<md_t*>(e->data) = record;
+      }
+
+      // エントリが参照しているレコードや Blob の参照カウントを増やす。(エントリがコピーされた時に呼び出される)
+      void dupRefs(Alc & alc) const {
+        if(isRef() || isBlob()) {
+          bool dup_rlt = alc.dup(isRef() ? ref() : blob());
+          assert(dup_rlt != false);
+        }
+      }
+
+      // エントリが参照しているレコードや Blob を解放する。
+      void releaseRefs(Alc & alc) const {
+        if(isRef()) {
+          if(alc.undup(ref())) {
+            alc.ptr<Entry>(ref())->releaseRefs(alc);
+            alc.release_no_undup(ref());
+          }
+        } else if(isBlob()) {
+          Blob::release(blob(), alc);
+        }
+      }
+
+    private:
+      static void initInline(char * place, const String & key, const String & stored_value, uint32_t val_size, uint32_t hash,
+                             uint32_t flags, uint32_t expires_at) {
+        Entry * e = reinterpret_cast<Entry*>(place);
+        e->hash = hash;
+        e->key_size = key.size();
+        e->flags = flags;
+        e->val_size = val_size;
+        memcpy(e->data, key.data(), key.size());
+        memcpy(e->data + key.size(), stored_value.data(), stored_value.size());
+        if(flags & EXPIRES) {
+          memcpy(e->data + key.size() + stored_value.size(), &expires_at, sizeof(uint32_t));
+        }
+      }
+
+      static uint32_t refSize() { return sizeof(Entry) + sizeof(md_t); }
+
+      // 値がエントリ本体に占めるバイト数 (init() で格納される形式での大きさ)
+      static uint32_t storedSizeOf(const String & value, const Alc & alc) {
+        if(spills(value, alc)) {
+          return sizeof(uint64_t);
+        }
+        return blobs(value, alc) ? sizeof(md_t) : value.size();
+      }
+      uint32_t expirySize() const { return hasExpiry() ? sizeof(uint32_t) : 0; }
+    };
+
+    // リストのセル。
+    // 一つのセルには PACK_SIZE バイトに収まる限り複数のエントリが詰めて格納される。
+    // (小さなエントリ毎に64バイト以上のブロックを割り当てて、それをポインタで辿る必要がなくなる)
+    // PACK_SIZE を越える大きなエントリは、それ単体で一つのセルを占める。
     class Cons {
       typedef uint32_t md_t;
       typedef allocator::FixedAllocator Alc;
 
     public:
-      static md_t cons(Alc & alc, const String & key, const String & value, md_t cdr) {
-        md_t md = alc.allocate(sizeof(Cons) + key.size() + value.size());
+      static const uint32_t PACK_SIZE = 128 - sizeof(md_t) - sizeof(uint32_t);
+
+      // size バイト分のエントリ領域を持つセルを割り当てる。(エントリの書き込みは呼び出し側が行う)
+      static md_t create(Alc & alc, uint32_t size, md_t cdr) {
+        md_t md = alc.allocate(sizeof(Cons) + size);
         assert(md != 0);
 
         Cons * c = alc.ptr<Cons>(md);
         c->next_ = cdr;
-        c->key_size_ = key.size();
-        c->val_size_ = value.size();
-        memcpy(c->data_, key.data(), key.size());
-        memcpy(c->data_ + key.size(), value.data(), value.size());
+        c->size_ = size;
         
         return md;
       }
 
+      // src から始まる size バイト分のエントリ群を dst にコピーする。
+      // レコードや Blob を参照しているエントリは、コピー先からも参照されるようになるので参照カウントを増やす。
+      static void copyEntries(char * dst, const char * src, uint32_t size, Alc & alc) {
+        memcpy(dst, src, size);
+        
+        const Entry * end = reinterpret_cast<const Entry*>(src + size);
+        for(const Entry * e = reinterpret_cast<const Entry*>(src); e != end; e = next(e)) {
+          e->dupRefs(alc);
+        }
+      }
+
       void release(Alc & alc) {
+        for(const Entry * e = begin(); e != end(); e = next(e)) {
+          e->releaseRefs(alc);
+        }
+        
         if(next_) {
           if(alc.undup(next_)) {
             alc.ptr<Cons>(next_)->release(alc);
@@ -69,20 +483,27 @@ private:
         }
       }
 
-      String key() const {
-        return String(data_, key_size_);
-      }
+      const Entry * begin() const { return reinterpret_cast<const Entry*>(data_); }
+      const Entry * end() const { return reinterpret_cast<const Entry*>(data_ + size_); }
+      static const Entry * next(const Entry * e) { return reinterpret_cast<const Entry*>(reinterpret_cast<const char*>(e) + e->size()); }
 
-      String value() const {
-        return String(data_+key_size_, val_size_);
+      const Entry * find(const String & key, uint32_t hash, const Alc & alc) const {
+        for(const Entry * e = begin(); e != end(); e = next(e)) {
+          if(e->match(key, hash, alc)) {
+            return e;
+          }
+        }
+        return NULL;
       }
-
+      
+      uint32_t size() const { return size_; }
+      char * data() { return data_; }
+      const char * data() const { return data_; }
       md_t cdr() const { return next_; }
 
     private:
       md_t next_;
-      uint32_t key_size_;
-      uint32_t val_size_;
+      uint32_t size_; // data_ に格納されているエントリ群の合計バイト数
       char data_[0];
     };
 
@@ -91,55 +512,333 @@ private:
       typedef allocator::FixedAllocator Alc;
       
     public:
+      // 時刻 now の時点で期限切れのエントリは callback に渡さない
       template <class Callback>
-      static void foreach(md_t list, Callback & callback, const Alc & alc) {
-        if(list != 0) {
-          Cons * c = alc.ptr<Cons>(list);
-          callback(c->key(), c->value());
-          foreach(c->cdr(), callback, alc);
+      static void foreach(md_t list, uint32_t now, Callback & callback, const Alc & alc) {
+        std::string buf;
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if(e->isExpired(now, alc)) {
+              continue;
+            }
+            const Entry * body = e->body(alc);
+            callback(body->key(), body->value(buf, alc));
+          }
         }
       }
 
-      static md_t insert(md_t list, const String & key, const String & value, bool & new_key, Alc & alc) {
-        if(find(list, key, alc)) {
-          new_key = false;
-          return insertImpl(list, key, value, alc);
+      // change.now が 0 でなく、リストに期限切れのエントリがある場合は、それらを除いてリストを作り直す。
+      static md_t insert(md_t list, const String & key, const String & value, uint32_t hash, Change & change, Alc & alc) {
+        change.added = Stats(1, key.size(), value.size(), change.expires_at != 0 ? 1 : 0);
+        
+        if(change.now != 0 && hasExpired(list, change.now, alc)) {
+          return rebuild(list, key, value, hash, change, alc);
+        }
+        
+        const Entry * old = findEntry(list, key, hash, alc);
+        if(old != NULL) {
+          change.removed.add(old->stats());
+          return insertImpl(list, key, value, hash, change.expires_at, change.value_flags, alc);
         } else {
-          new_key = true;
-          return Cons::cons(alc, key, value, list);
+          char * place;
+          md_t new_list = reserve(list, Entry::sizeIn(key, value, change.expires_at, alc), place, alc);
+          Entry::init(place, key, value, hash, alc, change.expires_at, change.value_flags);
+          return new_list;
         }
       }
       
-      static md_t insertImpl(md_t list, const String & key, const String & value, Alc & alc) {
-        Cons * c = alc.ptr<Cons>(list);
-        if(c->key() == key) {
+      static md_t insertImpl(md_t list, const String & key, const String & value, uint32_t hash, uint32_t expires_at,
+                             uint32_t value_flags, Alc & alc) {
+        const Cons * c = alc.ptr<Cons>(list);
+        const Entry * old = c->find(key, hash, alc);
+        if(old != NULL) {
           md_t cdr = c->cdr();
           if(cdr != 0) {
             bool dup_rlt = alc.dup(cdr);
             assert(dup_rlt != false);
           }
-          return Cons::cons(alc, key, value, cdr);
+
+          // 対象エントリのみを新しい値で置き換えたセルを作る
+          const uint32_t head_size = reinterpret_cast<const char*>(old) - c->data();
+          const uint32_t tail_size = c->size() - head_size - old->size();
+          const uint32_t new_size = Entry::sizeIn(key, value, expires_at, alc);
+          
+          md_t md = Cons::create(alc, head_size + new_size + tail_size, cdr);
+          char * dst = alc.ptr<Cons>(md)->data();
+          Cons::copyEntries(dst, c->data(), head_size, alc);
+          Entry::init(dst + head_size, key, value, hash, alc, expires_at, value_flags);
+          Cons::copyEntries(dst + head_size + new_size, reinterpret_cast<const char*>(Cons::next(old)), tail_size, alc);
+          return md;
         } else {
-          // XXX: 毎回 key と value のコピーが走るのは無駄。ポインタにした方が良いかも。
-          return Cons::cons(alc, c->key(), c->value(), insertImpl(c->cdr(), key, value, alc));
+          // NOTE: 大きなエントリはレコードの記述子がコピーされるだけなので、ここでコピーされるのはセルと小さなエントリのみ
+          md_t cdr = insertImpl(c->cdr(), key, value, hash, expires_at, value_flags, alc);
+          md_t md = Cons::create(alc, c->size(), cdr);
+          Cons::copyEntries(alc.ptr<Cons>(md)->data(), c->data(), c->size(), alc);
+          return md;
         }
       }
 
-      static String find(uint32_t list, const String & key, const Alc & alc) {
-        if(list == 0) {
-          return String::invalid();
+      // 時刻 now の時点で期限切れのエントリを含むかどうか
+      static bool hasExpired(md_t list, uint32_t now, const Alc & alc) {
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if(e->isExpired(now, alc)) {
+              return true;
+            }
+          }
         }
+        return false;
+      }
 
-        const Cons * c = alc.ptr<Cons>(list);
-        if(c->key() == key) {
-          return c->value();
-        } else {
-          return find(c->cdr(), key, alc);
+      // 期限切れのエントリを除いたリストを新たに作る。除いたエントリの集計値は change.removed に加える。
+      static md_t removeExpired(md_t list, uint32_t now, Change & change, Alc & alc) {
+        std::vector<const Entry*> entries;
+        collectLive(list, now, String::invalid(), 0, entries, change, alc);
+        return entries.empty() ? 0 : build(&entries[0], entries.size(), alc);
+      }
+
+      // 追い出しの対象かどうか。(参照ビットが立っていないか、時刻 now の時点で期限切れ)
+      // clock が NULL の場合は、全てのエントリの参照ビットが立っていないものとみなす。
+      static bool isCold(const Entry * e, uint32_t now, const ClockTable * clock, const Alc & alc) {
+        return clock == NULL || ! clock->isReferenced(e->hash) || e->isExpired(now, alc);
+      }
+
+      // 追い出しの対象のエントリを含むかどうか
+      static bool hasCold(md_t list, uint32_t now, const ClockTable * clock, const Alc & alc) {
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if(isCold(e, now, clock, alc)) {
+              return true;
+            }
+          }
+        }
+        return false;
+      }
+
+      // 追い出しの対象のエントリを除いたリストを新たに作る。除いたエントリの集計値は change.removed に加える。
+      // 残したエントリの参照ビットは落とされる。(次に一巡してくるまでに検索されなければ追い出される)
+      static md_t removeCold(md_t list, uint32_t now, ClockTable * clock, Change & change, Alc & alc) {
+        std::vector<const Entry*> entries;
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if(isCold(e, now, clock, alc)) {
+              drop(e, change, alc);
+            } else {
+              entries.push_back(e);
+            }
+          }
+        }
+        
+        md_t new_list = entries.empty() ? 0 : build(&entries[0], entries.size(), alc);
+        clearReferenced(new_list, clock, alc);
+        return new_list;
+      }
+
+      // リスト内の全てのエントリの参照ビットを(clock の上で)落とす。リスト自体は書き換えない。
+      static void clearReferenced(md_t list, ClockTable * clock, const Alc & alc) {
+        if(clock == NULL) {
+          return;
+        }
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            clock->clear(e->hash);
+          }
         }
       }
 
+      // リストに含まれるエントリの数
+      static uint32_t length(md_t list, const Alc & alc) {
+        uint32_t length = 0;
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            length++;
+          }
+        }
+        return length;
+      }
+
+      // ハッシュ値が (hash & mask) == prefix を満たすエントリの集計値を返す
+      static Stats stats(md_t list, uint32_t prefix, uint32_t mask, const Alc & alc) {
+        Stats stats;
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if((e->hash & mask) == prefix) {
+              stats.add(e->stats());
+            }
+          }
+        }
+        return stats;
+      }
+
+      // stats() の内、時刻 now の時点で期限切れのエントリの集計値を返す
+      static Stats expiredStats(md_t list, uint32_t prefix, uint32_t mask, uint32_t now, const Alc & alc) {
+        Stats stats;
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if((e->hash & mask) == prefix && e->isExpired(now, alc)) {
+              stats.add(e->stats());
+            }
+          }
+        }
+        return stats;
+      }
+
+      // key に対応するエントリ本体を返す。存在しない場合は NULL を返す。
+      static const Entry * find(md_t list, const String & key, uint32_t hash, const Alc & alc) {
+        const Entry * e = findEntry(list, key, hash, alc);
+        if(e == NULL) {
+          return NULL;
+        }
+        return e->body(alc);
+      }
+
+      static const Entry * findEntry(md_t list, const String & key, uint32_t hash, const Alc & alc) {
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Entry * e = alc.ptr<Cons>(list)->find(key, hash, alc);
+          if(e != NULL) {
+            return e;
+          }
+        }
+        return NULL;
+      }
+
+      // 二つのリストのエントリを合わせたリストを新たに作る。
+      // 両方に存在するキーは policy に従ってどちらか一方のみを残し、捨てた方のエントリの集計値を removed に加える。
+      static md_t merge(md_t left, md_t right, MergePolicy policy, Stats & removed, Alc & alc) {
+        std::vector<const Entry*> entries;
+        for(; left != 0; left = alc.ptr<Cons>(left)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(left);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            entries.push_back(e);
+          }
+        }
+
+        const size_t left_count = entries.size();
+        for(; right != 0; right = alc.ptr<Cons>(right)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(right);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            const Entry * body = e->body(alc);
+            size_t i = 0;
+            for(; i < left_count; i++) {
+              if(entries[i] != NULL && entries[i]->match(body->key(), body->hash, alc)) {
+                break;
+              }
+            }
+
+            if(i == left_count) {
+              entries.push_back(e);
+            } else if(policy == PREFER_LEFT) {
+              removed.add(e->stats());
+            } else {
+              removed.add(entries[i]->stats());
+              entries[i] = NULL;
+              entries.push_back(e);
+            }
+          }
+        }
+
+        entries.erase(std::remove(entries.begin(), entries.end(), static_cast<const Entry*>(NULL)), entries.end());
+        return entries.empty() ? 0 : build(&entries[0], entries.size(), alc);
+      }
+
+      // 既存のエントリ群を詰めて格納したリストを新たに作る。(レコードは複製されずに共有される)
+      static md_t build(const Entry * const * entries, uint32_t count, Alc & alc) {
+        md_t list = 0;
+        for(uint32_t beg=0; beg < count;) {
+          uint32_t size = entries[beg]->size();
+          uint32_t end = beg+1;
+          for(; end < count && size + entries[end]->size() <= Cons::PACK_SIZE; end++) {
+            size += entries[end]->size();
+          }
+          
+          list = Cons::create(alc, size, list);
+          char * dst = alc.ptr<Cons>(list)->data();
+          for(; beg < end; beg++) {
+            Cons::copyEntries(dst, reinterpret_cast<const char*>(entries[beg]), entries[beg]->size(), alc);
+            dst += entries[beg]->size();
+          }
+        }
+        return list;
+      }
+      
     private:
+      // 期限切れのエントリと key の古いエントリを除き、key と value のエントリを加えたリストを作り直す。
+      static md_t rebuild(md_t list, const String & key, const String & value, uint32_t hash, Change & change, Alc & alc) {
+        std::vector<const Entry*> entries;
+        collectLive(list, change.now, key, hash, entries, change, alc);
+
+        // 新しいエントリは一旦作業領域に書き込んでから、他のエントリと一緒に詰め直す
+        uint32_t buf[Entry::INLINE_LIMIT / sizeof(uint32_t)];
+        Entry * e = reinterpret_cast<Entry*>(buf);
+        Entry::init(reinterpret_cast<char*>(buf), key, value, hash, alc, change.expires_at, change.value_flags);
+        entries.push_back(e);
+        
+        md_t new_list = build(&entries[0], entries.size(), alc);
+        e->releaseRefs(alc); // build() で増えた分を除けば、作業領域からの参照は不要
+        return new_list;
+      }
+
+      // 期限切れでなく、key でもないエントリを entries に集める。除いたエントリの集計値は change.removed に加える。
+      static void collectLive(md_t list, uint32_t now, const String & key, uint32_t hash,
+                              std::vector<const Entry*> & entries, Change & change, const Alc & alc) {
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if(key.data() != String::invalid().data() && e->match(key, hash, alc)) {
+              change.removed.add(e->stats()); // 上書きされるエントリ
+            } else if(e->isExpired(now, alc)) {
+              drop(e, change, alc);
+            } else {
+              entries.push_back(e);
+            }
+          }
+        }
+      }
+
+      // 期限切れや追い出しでエントリを取り除いたことを change に記録する
+      static void drop(const Entry * e, Change & change, const Alc & alc) {
+        change.removed.add(e->stats());
+        if(change.dropped != NULL) {
+          change.dropped->push_back(e->body(alc)->key());
+        }
+      }
       
+      // 先頭に size バイトのエントリを追加するための領域を確保したリストを返す。(書き込み先は place に格納される)
+      // 先頭セルに空きがあれば、そのセルのコピーの末尾に領域を確保し、なければ新しいセルを先頭に追加する。
+      static md_t reserve(md_t list, uint32_t size, char *& place, Alc & alc) {
+        if(list != 0) {
+          const Cons * head = alc.ptr<Cons>(list);
+          if(head->size() + size <= Cons::PACK_SIZE) {
+            md_t cdr = head->cdr();
+            if(cdr != 0) {
+              bool dup_rlt = alc.dup(cdr);
+              assert(dup_rlt != false);
+            }
+            
+            md_t md = Cons::create(alc, head->size() + size, cdr);
+            char * dst = alc.ptr<Cons>(md)->data();
+            Cons::copyEntries(dst, head->data(), head->size(), alc);
+            place = dst + head->size();
+            return md;
+          }
+        }
+
+        if(list != 0) {
+          bool dup_rlt = alc.dup(list); // 新しいセルからも参照される
+          assert(dup_rlt != false);
+        }
+        md_t md = Cons::create(alc, size, list);
+        place = alc.ptr<Cons>(md)->data();
+        return md;
+      }
     };
 
     class Node {
@@ -147,115 +846,429 @@ private:
       typedef allocator::FixedAllocator Alc;
       
     public:
+      // ハッシュ値は32ビットなので、それ以上の段数のノードは作れない
+      static const uint32_t MAX_LEVEL = 8;
+
+      // buildList() でキーの重複を総当たりで調べるリストの長さの上限 (これより長いリストはハッシュ値で並べ替えてから調べる)
+      static const size_t DUPLICATE_SCAN_LIMIT = 32;
+      
       void init(Alc & alc) {
         memset(nodes_, 0, sizeof(nodes_));
+        sub_mask_ = 0;
+        buckets_ = 16;
+        stats_ = Stats();
       }
 
-      void release(Alc & alc, uint32_t depth) {
+      const Stats & stats() const { return stats_; }
+      uint32_t buckets() const { return buckets_; }
+
+      void release(Alc & alc) {
         for(int i=0; i < 16; i++) {
-          if(nodes_[i] == 0) {
-            continue;
+          releaseSlot(nodes_[i], isSubNode(i), alc);
+        }
+      }
+
+      // hash はキーのハッシュ値、level はこのノードの段数(ルートが0)。
+      // 経路上にコピーされた各ノードの集計値には change が反映される。
+      md_t store(const String & key, const String & value, uint32_t hash, uint32_t level,
+                 const ResizePolicy & policy, bool over_average, Change & change, Alc & alc) {
+        uint32_t idx = nthIndex(hash, level);
+        bool is_sub = isSubNode(idx);
+        md_t slot = storeSlot(nodes_[idx], is_sub, key, value, hash, level, policy, over_average, change, alc);
+        md_t md = is_sub ? setSubNode(alc, idx, slot) : setList(alc, idx, slot);
+
+        Node * new_node = alc.ptr<Node>(md);
+        new_node->stats_.add(change.added);
+        new_node->stats_.sub(change.removed);
+        new_node->buckets_ += change.buckets;
+        return md;
+      }
+
+      // hash を含むリストを rewriter(list, change, alc) が返すリストで置き換えたノードを返す。(リストの分割は行わない)
+      // 経路上のノードのコピーと集計値の更新は store() と同様。
+      template <class Rewriter>
+      md_t rewrite(uint32_t hash, uint32_t level, Rewriter & rewriter, Change & change, Alc & alc) {
+        uint32_t idx = nthIndex(hash, level);
+        bool is_sub = isSubNode(idx);
+        md_t slot = rewriteSlot(nodes_[idx], is_sub, hash, level, rewriter, change, alc);
+        md_t md = is_sub ? setSubNode(alc, idx, slot) : setList(alc, idx, slot);
+
+        Node * new_node = alc.ptr<Node>(md);
+        new_node->stats_.add(change.added);
+        new_node->stats_.sub(change.removed);
+        return md;
+      }
+
+      const Entry * find(const String & key, uint32_t hash, uint32_t level, const Alc & alc) const {
+        uint32_t idx = nthIndex(hash, level);
+        return findSlot(nodes_[idx], isSubNode(idx), key, hash, level, alc);
+      }
+
+      template <class Callback>
+      void foreach(uint32_t now, Callback & callback, const Alc & alc) {
+        for(uint32_t i=0; i < 16; i++) {
+          foreachSlot(nodes_[i], isSubNode(i), now, callback, alc);
+        }
+      }
+
+      // このノード以下の index 番目(0始まり)のエントリを返す。
+      // 各部分木の集計値(エントリ数)を使って、該当するエントリを含む部分木のみを辿る。
+      const Entry * entryAt(uint64_t index, const Alc & alc) const {
+        for(uint32_t i=0; i < 16; i++) {
+          const Entry * e = entryAtSlot(nodes_[i], isSubNode(i), index, alc);
+          if(e != NULL) {
+            return e;
           }
-          
-          if(alc.undup(nodes_[i])) {
-            if(depth > 0) {
-              alc.ptr<Node>(nodes_[i])->release(alc, depth-1);
-            } else {
-              alc.ptr<Cons>(nodes_[i])->release(alc);
-            }
-            alc.release_no_undup(nodes_[i]);
+        }
+        return NULL;
+      }
+
+      // left と right (共に level 段目) を合わせたノードを新たに作る。
+      static md_t merge(const Node * left, const Node * right, uint32_t level, MergePolicy policy,
+                        const ResizePolicy & resize_policy, Alc & alc) {
+        md_t md = alc.allocate(sizeof(Node));
+        assert(md != 0);
+
+        Node * node = alc.ptr<Node>(md);
+        node->init(alc);
+        node->buckets_ = 0;
+        node->stats_ = left->stats_;
+        node->stats_.add(right->stats_);
+        
+        Stats removed;
+        for(uint32_t i=0; i < 16; i++) {
+          bool is_sub;
+          node->nodes_[i] = mergeSlot(left->nodes_[i], left->isSubNode(i), right->nodes_[i], right->isSubNode(i),
+                                      level, policy, resize_policy, removed, is_sub, alc);
+          if(is_sub) {
+            node->sub_mask_ |= 1 << i;
           }
+          node->buckets_ += slotBuckets(node->nodes_[i], is_sub, alc);
         }
+        node->stats_.sub(removed);
+        
+        return md;
       }
 
-      md_t store(const String & key, const String & value, uint32_t hash, uint32_t depth, bool & new_key, Alc & alc) {
-        uint32_t idx = index(hash);
-        if(depth == 0) {
-          md_t list = getList(alc, idx);
-          md_t new_list = List::insert(list, key, value, new_key, alc);
-          return setList(alc, idx, new_list);
-        } else {
-          md_t new_sub_node = getSubNode(alc, idx)->store(key, value, next(hash), depth-1, new_key, alc);
-          return setSubNode(alc, idx, new_sub_node);
+      /*
+       * 以下は level 段目のノード(またはディレクトリ)の一スロットに対する操作。
+       * スロットはリストか、一段深い(level+1段目の)ノードを保持する。(is_sub が真なら後者)
+       */
+      
+      // スロットに key と value を追加し、新しいスロットの値を返す。
+      // 挿入後のリストが policy の条件を満たす場合は、そのリストを一段深いノードに分割する。(is_sub が更新される)
+      static md_t storeSlot(md_t slot, bool & is_sub, const String & key, const String & value, uint32_t hash, uint32_t level,
+                            const ResizePolicy & policy, bool over_average, Change & change, Alc & alc) {
+        if(is_sub) {
+          return alc.ptr<Node>(slot)->store(key, value, hash, level+1, policy, over_average, change, alc);
+        }
+        
+        md_t new_list = List::insert(slot, key, value, hash, change, alc);
+        if(needSplit(List::length(new_list, alc), level, policy, over_average)) {
+          is_sub = true;
+          change.buckets += 15;
+          md_t md = relocateEntries(alc, new_list, level+1);
+          releaseSlot(new_list, false, alc); // エントリは分割後のリストにコピーされている
+          return md;
         }
+        return new_list;
       }
 
-      String find(const String & key, uint32_t hash, uint32_t depth, const Alc & alc) const {
-        uint32_t idx = index(hash);
-        if(depth == 0) {
-          return List::find(getList(alc, idx), key, alc);
+      template <class Rewriter>
+      static md_t rewriteSlot(md_t slot, bool is_sub, uint32_t hash, uint32_t level,
+                              Rewriter & rewriter, Change & change, Alc & alc) {
+        if(is_sub) {
+          return alc.ptr<Node>(slot)->rewrite(hash, level+1, rewriter, change, alc);
+        }
+        return rewriter(slot, change, alc);
+      }
+
+      // hash を含むリストを返す。bits にはそのリストに到達するまでに使われたハッシュ値のビット数が格納される。
+      static md_t listOf(md_t slot, bool is_sub, uint32_t hash, uint32_t level, uint32_t & bits, const Alc & alc) {
+        for(; is_sub; level++) {
+          const Node * node = alc.ptr<Node>(slot);
+          uint32_t idx = nthIndex(hash, level+1);
+          slot = node->nodes_[idx];
+          is_sub = node->isSubNode(idx);
+        }
+        bits = 4 * (level+1);
+        return slot;
+      }
+
+      static const Entry * findSlot(md_t slot, bool is_sub, const String & key, uint32_t hash, uint32_t level, const Alc & alc) {
+        if(is_sub) {
+          return alc.ptr<Node>(slot)->find(key, hash, level+1, alc);
+        } else {
+          return List::find(slot, key, hash, alc);
+        }
+      }
+      
+      template <class Callback>
+      static void foreachSlot(md_t slot, bool is_sub, uint32_t now, Callback & callback, const Alc & alc) {
+        if(slot == 0) {
+          return;
+        }
+        
+        if(is_sub) {
+          alc.ptr<Node>(slot)->foreach(now, callback, alc);
         } else {
-          return getSubNode(alc, idx)->find(key, next(hash), depth-1, alc);
+          List::foreach(slot, now, callback, alc);
         }
       }
 
+      // スロット内の全てのエントリ(Cons内のエントリ)を callback(const Entry&) に渡す
       template <class Callback>
-      void foreach(Callback & callback, uint32_t depth, const Alc & alc) {
-        if(depth == 0) {
+      static void eachEntryInSlot(md_t slot, bool is_sub, Callback & callback, const Alc & alc) {
+        if(slot == 0) {
+          return;
+        }
+
+        if(is_sub) {
+          const Node * node = alc.ptr<Node>(slot);
           for(uint32_t i=0; i < 16; i++) {
-            if(nodes_[i]) {
-              List::foreach(getList(alc, i), callback, alc);
+            eachEntryInSlot(node->nodes_[i], node->isSubNode(i), callback, alc);
+          }
+          return;
+        }
+        
+        for(; slot != 0; slot = alc.ptr<Cons>(slot)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(slot);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            callback(*e);
+          }
+        }
+      }
+      
+      // スロット内の index 番目のエントリを返す。
+      // スロット内のエントリ数が index 以下の場合は、index からその数を引いて NULL を返す。
+      static const Entry * entryAtSlot(md_t slot, bool is_sub, uint64_t & index, const Alc & alc) {
+        if(slot == 0) {
+          return NULL;
+        }
+
+        if(is_sub) {
+          const Node * sub = alc.ptr<Node>(slot);
+          if(index < sub->stats_.count) {
+            return sub->entryAt(index, alc);
+          }
+          index -= sub->stats_.count;
+          return NULL;
+        }
+          
+        for(; slot != 0; slot = alc.ptr<Cons>(slot)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(slot);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            if(index == 0) {
+              return e->body(alc);
             }
+            index--;
+          }
+        }
+        return NULL;
+      }
+
+      // ハッシュ値が (hash & mask) == prefix を満たすスロット内のエントリの集計値
+      // (mask がスロットの位置よりも上位のビットを含まない場合は、スロット内の全てのエントリが対象となる)
+      static Stats slotStats(md_t slot, bool is_sub, uint32_t prefix, uint32_t mask, const Alc & alc) {
+        return is_sub ? alc.ptr<Node>(slot)->stats_ : List::stats(slot, prefix, mask, alc);
+      }
+
+      // slotStats() の内、時刻 now の時点で期限切れのエントリの集計値。(有効期限を持つエントリがない部分木は辿らない)
+      static Stats expiredSlotStats(md_t slot, bool is_sub, uint32_t prefix, uint32_t mask, uint32_t now, const Alc & alc) {
+        if(! is_sub) {
+          return List::expiredStats(slot, prefix, mask, now, alc);
+        }
+
+        Stats stats;
+        const Node * node = alc.ptr<Node>(slot);
+        if(node->stats_.expiring != 0) {
+          for(uint32_t i=0; i < 16; i++) {
+            stats.add(expiredSlotStats(node->nodes_[i], node->isSubNode(i), prefix, mask, now, alc));
+          }
+        }
+        return stats;
+      }
+
+      static uint32_t slotBuckets(md_t slot, bool is_sub, const Alc & alc) {
+        return is_sub ? alc.ptr<Node>(slot)->buckets_ : 1;
+      }
+      
+      static void releaseSlot(md_t slot, bool is_sub, Alc & alc) {
+        if(slot == 0) {
+          return;
+        }
+          
+        if(alc.undup(slot)) {
+          if(is_sub) {
+            alc.ptr<Node>(slot)->release(alc);
+          } else {
+            alc.ptr<Cons>(slot)->release(alc);
+          }
+          alc.release_no_undup(slot);
+        }
+      }
+
+      // 二つのスロットを合わせた新しいスロットの値を返す。(返り値は新たな参照を持つ)
+      // 片側にしか存在しない(または両側で同一の)部分木は記述子をそのまま共有し、両側に存在する部分木のみを再帰的に辿る。
+      // 片側がリストで他方がノードの場合は、リストの方を一段深いノードに分割してから合わせる。
+      // 捨てられた(または重複して数えられた)エントリの集計値は removed に加えられる。
+      static md_t mergeSlot(md_t l, bool l_is_sub, md_t r, bool r_is_sub, uint32_t level, MergePolicy policy,
+                            const ResizePolicy & resize_policy, Stats & removed, bool & is_sub, Alc & alc) {
+        if(l == 0 || r == 0 || l == r) {
+          is_sub = l != 0 ? l_is_sub : r_is_sub;
+          if(l == r && l != 0) {
+            removed.add(slotStats(l, l_is_sub, 0, 0, alc));
+          }
+          return share(l != 0 ? l : r, alc);
+        }
+
+        if(! l_is_sub && ! r_is_sub) {
+          md_t list = List::merge(l, r, policy, removed, alc);
+          is_sub = needSplit(List::length(list, alc), level, resize_policy, false);
+          if(! is_sub) {
+            return list;
+          }
+          md_t md = relocateEntries(alc, list, level+1);
+          releaseSlot(list, false, alc); // エントリは分割後のリストにコピーされている
+          return md;
+        }
+        
+        const md_t l_md = l_is_sub ? l : relocateEntries(alc, l, level+1);
+        const md_t r_md = r_is_sub ? r : relocateEntries(alc, r, level+1);
+        const Node * l_sub = alc.ptr<Node>(l_md);
+        const Node * r_sub = alc.ptr<Node>(r_md);
+        md_t md = merge(l_sub, r_sub, level+1, policy, resize_policy, alc);
+        is_sub = true;
+
+        Stats sub_removed = l_sub->stats_;
+        sub_removed.add(r_sub->stats_);
+        sub_removed.sub(alc.ptr<Node>(md)->stats_);
+        removed.add(sub_removed);
+
+        // リストを分割して作ったノードは不要 (合わせた結果に共有されたリストは、そちらの参照で残る)
+        if(l_md != l) {
+          releaseSlot(l_md, true, alc);
+        }
+        if(r_md != r) {
+          releaseSlot(r_md, true, alc);
+        }
+        return md;
+      }
+
+      // 既存のスロット(部分木)を新しい親からも参照するために、参照カウントを増やして返す。(0 ならそのまま)
+      static md_t share(md_t slot, Alc & alc) {
+        if(slot != 0) {
+          bool dup_rlt = alc.dup(slot);
+          assert(dup_rlt != false);
+        }
+        return slot;
+      }
+      
+      // list のエントリを、level 段目のハッシュ値で16個のリストに振り分けたノードを新たに作る
+      static md_t relocateEntries(Alc & alc, md_t list, uint32_t level) {
+        md_t md = alc.allocate(sizeof(Node));
+        assert(md != 0);
+        
+        Node * node = alc.ptr<Node>(md);
+        node->init(alc);
+        
+        relocateEntriesImpl(alc, *node, list, level);
+        
+        return md;
+      }
+
+      static void relocateEntriesImpl(Alc & alc, Node & node, md_t list, uint32_t level) {
+        std::vector<const Entry*> entries[16];
+        for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+          const Cons * c = alc.ptr<Cons>(list);
+          for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+            entries[nthIndex(e->hash, level)].push_back(e);
+            node.stats_.add(e->stats());
           }
-        } else {
-          for(uint32_t i=0; i < 16; i++) {
-            if(nodes_[i]) {
-              getSubNode(alc, i)->foreach(callback, depth-1, alc);
-            }
+        }
+
+        for(uint32_t i=0; i < 16; i++) {
+          if(! entries[i].empty()) {
+            node.nodes_[i] = List::build(&entries[i][0], entries[i].size(), alc);
           }
         }
       }
 
-      md_t resize(Alc & alc, uint32_t depth, uint32_t next_depth) const {
-        md_t md = alc.allocate(sizeof(Node));
-        assert(md != 0);
-        
-        Node * sub = alc.ptr<Node>(md);
+      // source から、ハッシュ値の下位 4*(level+1) ビットが prefix と一致するエントリを取り出して、level 段目のスロットを新たに作る。
+      // source は RootNode::build() を参照。leaf_level 段目までは(エントリがある限り)ノードを作り、そこでリストにする。
+      // リストが policy の max_chain を越える場合は、store() と同様に一段深いノードに分割する。
+      // 作ったスロットのエントリの集計値とリストの数は、stats と buckets に加えられる。
+      template <class Source>
+      static md_t buildSlot(Source & source, uint32_t prefix, uint32_t level, uint32_t leaf_level, const ResizePolicy & policy,
+                            bool & is_sub, Stats & stats, uint32_t & buckets, Alc & alc) {
+        is_sub = false;
+        if(source.empty() || ! matches(source.front().hash, prefix, level)) {
+          buckets += 1;
+          return 0;
+        }
 
-        if(depth == 0) {
-          for(uint32_t i=0; i < 16; i++) {
-            sub->nodes_[i] = relocateEntries(alc, getList(alc, i), next_depth);
-          }
-        } else {
-          for(uint32_t i=0; i < 16; i++) {
-            sub->nodes_[i] = getSubNode(alc, i)->resize(alc, depth-1, next_depth);
+        if(level >= leaf_level) {
+          md_t list = buildList(source, prefix, level, stats, alc);
+          if(! needSplit(List::length(list, alc), level, policy, false)) {
+            buckets += 1;
+            return list;
           }
+          md_t md = relocateEntries(alc, list, level+1);
+          releaseSlot(list, false, alc); // エントリは分割後のリストにコピーされている
+          is_sub = true;
+          buckets += 16;
+          return md;
         }
-        
-        return md;
-      }
 
-      md_t relocateEntries(Alc & alc, md_t list, uint32_t next_depth) const {
         md_t md = alc.allocate(sizeof(Node));
         assert(md != 0);
-        
+
         Node * node = alc.ptr<Node>(md);
         node->init(alc);
-        
-        relocateEntriesImpl(alc, *node, list, next_depth);
-        
+        node->buckets_ = 0;
+        for(uint32_t i=0; i < 16; i++) {
+          bool sub;
+          node->nodes_[i] = buildSlot(source, prefix | (i << (4*(level+1))), level+1, leaf_level, policy,
+                                      sub, node->stats_, node->buckets_, alc);
+          if(sub) {
+            node->sub_mask_ |= 1 << i;
+          }
+        }
+        stats.add(node->stats_);
+        buckets += node->buckets_;
+        is_sub = true;
         return md;
       }
 
-      void relocateEntriesImpl(Alc & alc, Node & node, md_t list, uint32_t next_depth) const {
-        if(list == 0) {
+      // スロット内の全てのリストを、トライを辿る順(RootNode::trieOrder() の順)に callback(md_t list) に渡す。(空のリストは除く)
+      template <class Callback>
+      static void eachListInSlot(md_t slot, bool is_sub, Callback & callback, const Alc & alc) {
+        if(slot == 0) {
           return;
         }
-        
-        const Cons * c = alc.ptr<Cons>(list);
 
-        uint32_t idx = nthIndex(c->key().hash(), next_depth);
-        node.nodes_[idx] = Cons::cons(alc, c->key(), c->value(), node.nodes_[idx]);
-        
-        relocateEntriesImpl(alc, node, c->cdr(), next_depth);
+        if(is_sub) {
+          const Node * node = alc.ptr<Node>(slot);
+          for(uint32_t i=0; i < 16; i++) {
+            eachListInSlot(node->nodes_[i], node->isSubNode(i), callback, alc);
+          }
+          return;
+        }
+        callback(slot);
       }
 
+      bool isSubNode(uint32_t index) const {
+        return sub_mask_ & (1 << index);
+      }
+      
       md_t getList(const Alc & alc, uint32_t index) const {
         return nodes_[index];
       }
 
       md_t setList(Alc & alc, uint32_t index, md_t list) {
-        return setSubNode(alc, index, list);
+        md_t md = setSubNode(alc, index, list);
+        alc.ptr<Node>(md)->sub_mask_ &= ~(1 << index);
+        return md;
       }
 
 
@@ -269,12 +1282,12 @@ private:
         
         memcpy(new_node, this, sizeof(Node));
         new_node->nodes_[index] = sub_node;
+        new_node->sub_mask_ |= 1 << index;
 
+        // 置き換えなかったスロットは、コピー元と新しいノードの両方から参照される
         for(uint32_t i=0; i < 16; i++) {
-          if(i != index && nodes_[i]) {
-            // NOTE: 以下の行が結構ボトルネックになっている
-            //bool dup_rlt = alc.dup(nodes_[i]);
-            //assert(dup_rlt);
+          if(i != index) {
+            share(nodes_[i], alc);
           }
         }
         
@@ -292,126 +1305,847 @@ private:
       static uint32_t next(uint32_t hash) {
         return hash >> 4;
       }
+
+    private:
+      // level 段目の長さ length のリストを分割すべきかどうか
+      static bool needSplit(uint32_t length, uint32_t level, const ResizePolicy & policy, bool over_average) {
+        if(level+1 >= MAX_LEVEL) {
+          return false;
+        }
+        return length > policy.max_chain || (over_average && length > policy.average_chain);
+      }
+      
+      // hash が level 段目の prefix のスロットに属するかどうか
+      static bool matches(uint32_t hash, uint32_t prefix, uint32_t level) {
+        const uint32_t mask = level+1 >= MAX_LEVEL ? 0xFFFFFFFF : (1u << (4*(level+1))) - 1;
+        return (hash & mask) == prefix;
+      }
+
+      // source から level 段目の prefix のスロットに属するエントリを全て取り出して、一つのリストにする
+      template <class Source>
+      static md_t buildList(Source & source, uint32_t prefix, uint32_t level, Stats & stats, Alc & alc) {
+        // 各エントリは一旦作業領域に書き込んでから、rebuild() と同様にまとめて詰め直す
+        std::vector<uint32_t> buf;
+        std::vector<size_t> offsets;
+        for(; ! source.empty() && matches(source.front().hash, prefix, level); source.pop()) {
+          const BulkEntry & b = source.front();
+          offsets.push_back(buf.size());
+          buf.resize(buf.size() + Entry::sizeIn(b.key, b.value, b.expires_at, alc) / sizeof(uint32_t));
+          Entry::init(reinterpret_cast<char*>(&buf[offsets.back()]), b.key, b.value, b.hash, alc, b.expires_at, b.value_flags);
+        }
+
+        std::vector<const Entry*> entries(offsets.size());
+        for(size_t i=0; i < offsets.size(); i++) {
+          entries[i] = reinterpret_cast<const Entry*>(&buf[offsets[i]]);
+        }
+
+        // 同じキーが複数回現れた場合は、最後のものを残す (同じキーは同じハッシュ値を持つので、同じリストに集まる)
+        const size_t kept = dropDuplicates(entries, alc);
+        for(size_t i=0; i < kept; i++) {
+          stats.add(entries[i]->stats());
+        }
+
+        md_t list = kept == 0 ? 0 : List::build(&entries[0], kept, alc);
+        for(size_t i=0; i < entries.size(); i++) {
+          entries[i]->releaseRefs(alc); // build() で増えた分を除けば、作業領域からの参照は不要 (除いたものはここで解放される)
+        }
+        return list;
+      }
+
+      // 後に同じキーのエントリがあるものを entries の末尾に移し、残すエントリの数を返す。(残すエントリの順序は保たれる)
+      // 短いリストでは総当たりで、長いリストではハッシュ値で並べ替えてから比べる。
+      static size_t dropDuplicates(std::vector<const Entry*> & entries, const Alc & alc) {
+        std::vector<const Entry*> dropped;
+        if(entries.size() <= DUPLICATE_SCAN_LIMIT) {
+          for(size_t i=0; i < entries.size(); i++) {
+            for(size_t j=i+1; j < entries.size(); j++) {
+              if(isSameKey(entries[i], entries[j], alc)) {
+                dropped.push_back(entries[i]);
+                entries[i] = NULL;
+                break;
+              }
+            }
+          }
+        } else {
+          std::vector<std::pair<uint32_t, size_t> > by_hash(entries.size());
+          for(size_t i=0; i < entries.size(); i++) {
+            by_hash[i] = std::make_pair(entries[i]->hash, i);
+          }
+          std::sort(by_hash.begin(), by_hash.end());
+          for(size_t i=0; i < by_hash.size(); i++) {
+            const size_t x = by_hash[i].second;
+            for(size_t j=i+1; j < by_hash.size() && by_hash[j].first == by_hash[i].first; j++) {
+              if(isSameKey(entries[x], entries[by_hash[j].second], alc)) {
+                dropped.push_back(entries[x]);
+                entries[x] = NULL;
+                break;
+              }
+            }
+          }
+        }
+        if(dropped.empty()) {
+          return entries.size();
+        }
+
+        size_t n = 0;
+        for(size_t i=0; i < entries.size(); i++) {
+          if(entries[i] != NULL) {
+            entries[n++] = entries[i];
+          }
+        }
+        std::copy(dropped.begin(), dropped.end(), entries.begin() + n);
+        return n;
+      }
+
+      static bool isSameKey(const Entry * a, const Entry * b, const Alc & alc) {
+        return a->hash == b->hash && b->match(a->body(alc)->key(), a->hash, alc);
+      }
       
     private:
       md_t nodes_[16];
+      uint32_t sub_mask_; // i番目のビットが立っている場合は nodes_[i] はノード、そうでなければリスト
+      uint32_t buckets_;  // このノード以下のリスト(バケット)の数 (空のものも含む)
+      Stats stats_;       // このノード以下に含まれるエントリの集計値
     };
 
+    // テーブルの根。
+    // 上位の段のノード群の代わりに、ハッシュ値の下位 directory_bits ビットで直接索引する 2^directory_bits 個のスロット(ディレクトリ)を持つ。
+    // ディレクトリのスロットは (directory_bits/4 - 1) 段目のノードのスロットと同様に扱われ、その下には directory_bits/4 段目のノードが続く。
+    // 更新時にはディレクトリ全体がコピーされるので、directory_bits を大きくすると検索時に辿るノードは減るが、更新時のコピー量は増える。
+    //
+    // 以前は全てのリストを一斉に一段深くするリサイズを行っていたが、今は ResizePolicy に従って長くなったリストのみを個別に分割する。
+    // (一斉にリサイズすると、その前後で平均リスト長が16倍変動し、検索時間もそれに合わせて変動してしまう)
     class RootNode {
       typedef uint32_t md_t;
       typedef allocator::FixedAllocator Alc;
+
+      static const uint32_t FIND_GROUP_SIZE = 16;
       
     public:
-      RootNode(allocator::FixedAllocator & alc)
-        : count_(0),
-          next_resize_trigger_(16 * 4),
-          root_depth_(0),
-          root_(alc.allocate(sizeof(Node)))
-      {
-        if(root_) {
-          Node * node = alc.ptr<Node>(root_);
-          node->init(alc);
-        }
-      }
-
-      void release(allocator::FixedAllocator & alc) {
-        if(root_) {
-          if(alc.undup(root_)) {
-            Node * node = alc.ptr<Node>(root_);
-            node->release(alc, root_depth_);
-            
-            alc.release_no_undup(root_);
+      static const uint32_t MAX_DIRECTORY_BITS = 8;
+
+      // directory_bits ビットのディレクトリを持つ RootNode のサイズ
+      static uint32_t sizeOf(uint32_t directory_bits) {
+        return sizeof(RootNode) + sizeof(md_t) * (1 << directory_bits) + sizeof(uint32_t) * maskWords(directory_bits);
+      }
+      
+      static const uint32_t INITIAL_FILTER_CAPACITY = 1024;
+      
+      // 空のテーブルの RootNode を割り当てる
+      static md_t create(const ResizePolicy & policy, Alc & alc) {
+        const uint32_t directory_bits = policy.directory_bits;
+        assert(directory_bits % 4 == 0 && directory_bits >= 4 && directory_bits <= MAX_DIRECTORY_BITS);
+        
+        md_t md = alc.allocate(sizeOf(directory_bits));
+        if(md != 0) {
+          RootNode * node = alc.ptr<RootNode>(md);
+          memset(static_cast<void*>(node), 0, sizeOf(directory_bits));
+          node->directory_bits_ = directory_bits;
+          node->buckets_ = 1 << directory_bits;
+          if(policy.filter_bits_per_key != 0) {
+            node->filter_ = BloomFilter::create(INITIAL_FILTER_CAPACITY, policy.filter_bits_per_key, alc);
           }
         }
+        return md;
       }
 
-      operator bool() const { return root_ != 0; }
-      
       uint32_t count() const { return count_; }
 
+      // リスト(バケット)の数。count() / buckets() が平均リスト長となる。
+      uint32_t buckets(const Alc & alc) const { return buckets_; }
+
+      // index 番目(0始まり)のエントリ本体を返す。
+      const Entry * entryAt(uint64_t index, const Alc & alc) const {
+        for(uint32_t i=0; i < slotCount(); i++) {
+          const Entry * e = Node::entryAtSlot(slots_[i], isSubNode(i), index, alc);
+          if(e != NULL) {
+            return e;
+          }
+        }
+        return NULL;
+      }
+
+      // テーブル全体の集計値を返す。O(1) (取り除かれるまでの期限切れのエントリも含む)
+      const Stats & stats(const Alc & alc) const { return stats_; }
+
+      // 時刻 now の時点で期限切れのエントリを除いた stats(alc) を返す。
+      // 有効期限を持つエントリがなければ O(1)。あれば、それを含む部分木を走査して期限切れのエントリを差し引く。
+      Stats liveStats(uint32_t now, const Alc & alc) const {
+        Stats stats = stats_;
+        if(stats_.expiring != 0) {
+          for(uint32_t i=0; i < slotCount(); i++) {
+            stats.sub(Node::expiredSlotStats(slots_[i], isSubNode(i), 0, 0, now, alc));
+          }
+        }
+        return stats;
+      }
+
+      // 時刻 now の時点で期限切れのエントリを除いた stats(prefix, level, alc) を返す
+      Stats liveStats(uint32_t prefix, uint32_t level, uint32_t now, const Alc & alc) const {
+        Stats stats = this->stats(prefix, level, alc);
+        if(stats.expiring == 0) {
+          return stats;
+        }
+
+        // 該当する部分木を含むスロットを走査して、ハッシュ値が prefix と一致する期限切れのエントリを差し引く
+        const uint32_t mask = level >= 8 ? 0xFFFFFFFF : (1 << (4*level)) - 1;
+        prefix &= mask;
+        const uint32_t step = 4*level < directory_bits_ ? mask+1 : slotCount();
+        for(uint32_t i=prefix & (slotCount()-1); i < slotCount(); i += step) {
+          stats.sub(Node::expiredSlotStats(slots_[i], isSubNode(i), prefix, mask, now, alc));
+        }
+        return stats;
+      }
+
+      // ハッシュ値の下位 4*level ビットが prefix と一致するエントリ群(level段目の部分木)の集計値を返す。
+      // level がリストの段数を越える場合は、リスト内のエントリを走査して集計する。
+      // level がディレクトリの内側の段の場合は、該当する各スロットの集計値を足し合わせる。
+      Stats stats(uint32_t prefix, uint32_t level, const Alc & alc) const {
+        const uint32_t mask = level >= 8 ? 0xFFFFFFFF : (1 << (4*level)) - 1;
+        prefix &= mask;
+
+        if(4*level < directory_bits_) {
+          Stats stats;
+          for(uint32_t i=prefix; i < slotCount(); i += mask+1) {
+            stats.add(Node::slotStats(slots_[i], isSubNode(i), prefix, mask, alc));
+          }
+          return stats;
+        }
+        
+        const uint32_t slot = prefix & (slotCount()-1);
+        if(! isSubNode(slot)) {
+          return List::stats(slots_[slot], prefix, mask, alc);
+        }
+        
+        const Node * node = alc.ptr<Node>(slots_[slot]);
+        for(uint32_t l=directory_bits_/4; l < level; l++) {
+          const uint32_t idx = Node::nthIndex(prefix, l);
+          if(! node->isSubNode(idx)) {
+            return List::stats(node->getList(alc, idx), prefix, mask, alc);
+          }
+          node = node->getSubNode(alc, idx);
+        }
+        return node->stats();
+      }
+
+      // rootの参照を解放する。最後の参照だった場合は、他のrootと共有していない部分木、フィルタ、索引も解放される。
       static void releaseNode(md_t md, Alc & alc) {
         if(alc.undup(md)) {
-          // NOTE: 以下の行をコメントアウトするとMT環境でコアダンプを吐かなくなる
-          //alc.ptr<RootNode>(md)->release(alc);
+          RootNode * node = alc.ptr<RootNode>(md);
+          for(uint32_t i=0; i < node->slotCount(); i++) {
+            Node::releaseSlot(node->slots_[i], node->isSubNode(i), alc);
+          }
+          alc.release(node->filter_); // フィルタは各rootが一つずつ参照している
+          OrderedIndex::release(node->index_, alc);
           alc.release_no_undup(md);
         }
       }
 
-      static md_t store(md_t root, const String & key, const String & value, Alc & alc) {
+      // 公開を終えたrootを、解放できるようになるまで書き込み側が連結リストで保留するためのリンク。
+      // (rootの他の内容とは異なり公開後にも書き換えられるが、読み込み側はこれを参照しない)
+      md_t retiredNext() const { return retired_next_; }
+      void setRetiredNext(md_t md) { retired_next_ = md; }
+
+      static md_t store(md_t root, const String & key, const String & value, const ResizePolicy & policy, Alc & alc) {
+        return store(root, key, value, key.hash(), policy, alc);
+      }
+
+      // hash は key のハッシュ値。(同じテーブルの全てのキーで同じハッシュ関数を使う必要がある)
+      // expires_at が 0 でない場合は、エントリにそれを有効期限(Entry::now()基準の秒)として持たせる。
+      // 書き換えられるリストに含まれる期限切れのエントリは、この時に取り除かれる。
+      // value_flags は value の形式。(Entry::init() を参照)
+      static md_t store(md_t root, const String & key, const String & value, uint32_t hash, const ResizePolicy & policy, Alc & alc,
+                        uint32_t expires_at=0, uint32_t value_flags=0) {
         RootNode * node = alc.ptr<RootNode>(root);
-        if(node->count_ >= node->next_resize_trigger_) {
-          std::cout << "# " << node->count_ << ", " << node->next_resize_trigger_ << std::endl;
-          md_t new_root = node->resize(alc);
-          assert(new_root != 0);
+        md_t new_root = node->store(key, value, hash, policy, Change(Entry::now(), expires_at, value_flags), alc);
+        assert(new_root != 0);
+          
+        RootNode::releaseNode(root, alc);
+        return new_root;
+      }
 
-          RootNode::releaseNode(root, alc);
-          return store(new_root, key, value, alc);
-        } else {
-          md_t new_root = node->store(key, value, alc);
-          assert(new_root != 0);
+      // cursor の位置から最大 max_buckets 個のリストを調べ、時刻 now の時点で期限切れのエントリを取り除いたrootを返す。
+      // (取り除くものがなかった場合は root をそのまま返す。root の参照は返り値に引き継がれる)
+      // cursor は次に調べる位置に進められる。全てのリストを一巡すると 0 に戻るので、その時点で打ち切る。
+      // 取り除いたエントリの集計値は removed に加えられる。
+      static md_t sweep(md_t root, uint32_t & cursor, uint32_t max_buckets, uint32_t now, Stats & removed, Alc & alc) {
+        ExpiredRemover remover(now);
+        for(uint32_t i=0; i < max_buckets; i++) {
+          const RootNode * node = alc.ptr<RootNode>(root);
+          const uint32_t hash = reverseBits(cursor);
+          const uint32_t slot = hash & (node->slotCount()-1);
+          
+          uint32_t bits;
+          md_t list = Node::listOf(node->slots_[slot], node->isSubNode(slot), hash, node->directory_bits_/4 - 1, bits, alc);
+          if(List::hasExpired(list, now, alc)) {
+            if(! alc.hasRoom(node->rewriteBound(hash, 0, false, now, alc))) {
+              break; // 書き換えに必要な空きがない
+            }
+            Change change;
+            md_t new_root = alc.ptr<RootNode>(root)->rewrite(hash, remover, change, alc);
+            releaseNode(root, alc);
+            root = new_root;
+            removed.add(change.removed);
+          }
+
+          // 同じリストに属するハッシュ値(反転した空間では上位 bits ビットが共通)を飛ばす
+          cursor = bits >= 32 ? cursor+1 : (cursor | ((1u << (32-bits)) - 1)) + 1;
+          if(cursor == 0) {
+            break;
+          }
+        }
+        return root;
+      }
+
+      // CLOCK による追い出し。
+      // cursor の位置からリストを順に調べ、参照ビットが立っていない(または期限切れの)エントリを取り除いたrootを返す。
+      // 参照ビットが立っているエントリは、ビットを落として残す。取り除いたエントリの footprint() の合計が need に達するか、
+      // 全てのリストを二巡(一巡目で落としたビットを二巡目で確認する)した時点で打ち切る。
+      // 参照ビットは clock に持たせる。(NULL なら全てのエントリが対象となる)
+      // root の参照、cursor、removed の扱いは sweep() と同様。(ただし cursor が一巡しても打ち切らない)
+      static md_t evict(md_t root, uint32_t & cursor, uint64_t need, uint32_t now, ClockTable * clock, Stats & removed, Alc & alc) {
+        ColdRemover remover(now, clock);
+        const uint64_t limit = 2 * static_cast<uint64_t>(alc.ptr<RootNode>(root)->buckets_) + 1;
+        uint64_t freed = 0;
+        for(uint64_t i=0; i < limit && freed < need; i++) {
+          const RootNode * node = alc.ptr<RootNode>(root);
+          const uint32_t hash = reverseBits(cursor);
+          const uint32_t slot = hash & (node->slotCount()-1);
           
-          RootNode::releaseNode(root, alc);
-          return new_root;
+          uint32_t bits;
+          md_t list = Node::listOf(node->slots_[slot], node->isSubNode(slot), hash, node->directory_bits_/4 - 1, bits, alc);
+          if(List::hasCold(list, now, clock, alc)) {
+            if(! alc.hasRoom(node->rewriteBound(hash, 0, true, now, alc))) {
+              break; // 書き換えに必要な空きがない
+            }
+            Change change;
+            md_t new_root = alc.ptr<RootNode>(root)->rewrite(hash, remover, change, alc);
+            releaseNode(root, alc);
+            root = new_root;
+            removed.add(change.removed);
+            freed += footprint(change.removed);
+          } else {
+            List::clearReferenced(list, clock, alc);
+          }
+          
+          cursor = bits >= 32 ? cursor+1 : (cursor | ((1u << (32-bits)) - 1)) + 1;
         }
+        return root;
       }
 
-      String find(const String & key, const Alc & alc) const {
-        return alc.ptr<Node>(root_)->find(key, key.hash(), root_depth_, alc);
+      // エントリ群が占める概算のバイト数 (エントリのヘッダを含む。容量制限の判定に使う)
+      static uint64_t footprint(const Stats & stats) {
+        return stats.key_bytes + stats.value_bytes + stats.count * sizeof(Entry);
+      }
+
+      // store() が新たに割り当てうるバイト数の上限。(FixedAllocator::hasRoom() で事前に空きを確かめるのに使う)
+      // root と経路上のノードのコピー、リストの作り直しと分割、レコードと Blob、フィルタの作り直し、索引の経路のコピーを含む。
+      uint64_t storeBound(const String & key, const String & value, uint32_t hash, const ResizePolicy & policy,
+                          uint32_t expires_at, const Alc & alc) const {
+        uint64_t bound = rewriteBound(hash, 1, false, Entry::now(), alc) + Entry::initBound(key, value, expires_at, alc);
+        if(filter_ != 0 && count_ + 1 > alc.ptr<BloomFilter>(filter_)->capacity()) {
+          bound += Alc::blockSize(BloomFilter::sizeOf((count_ + 1) * 2, policy.filter_bits_per_key));
+        }
+        if(policy.ordered_index) {
+          bound += OrderedIndex::pathBound(index_, key, alc);
+        }
+        return bound;
+      }
+
+      const Entry * find(const String & key, const Alc & alc) const {
+        return find(key, key.hash(), alc);
+      }
+
+      const Entry * find(const String & key, uint32_t hash, const Alc & alc) const {
+        if(filter_ != 0 && ! alc.ptr<BloomFilter>(filter_)->mayContain(hash)) {
+          return NULL;
+        }
+        
+        const uint32_t slot = hash & (slotCount()-1);
+        return Node::findSlot(slots_[slot], isSubNode(slot), key, hash, directory_bits_/4 - 1, alc);
+      }
+
+      // 複数キーをまとめて検索する。
+      // FIND_GROUP_SIZE 個ずつ、先に全キーのハッシュ値を求めてから一段ずつ足並みを揃えて辿る。
+      // 各段では次に参照するノードをプリフェッチしておき、キー間でメモリアクセスの待ち時間を重ね合わせる。
+      // key_hashes は各キーのハッシュ値。(NULL の場合は String::hash() で求める)
+      void findMany(const String * keys, const uint32_t * key_hashes, const Entry ** results, uint32_t count, const Alc & alc) const {
+        for(uint32_t beg=0; beg < count; beg += FIND_GROUP_SIZE) {
+          const uint32_t n = count - beg < FIND_GROUP_SIZE ? count - beg : FIND_GROUP_SIZE;
+          uint32_t hashes[FIND_GROUP_SIZE];
+          const Node * nodes[FIND_GROUP_SIZE]; // リストに到達したキーは NULL
+          md_t lists[FIND_GROUP_SIZE];
+
+          const BloomFilter * filter = filter_ != 0 ? alc.ptr<BloomFilter>(filter_) : NULL;
+          if(filter != NULL) {
+            for(uint32_t i=0; i < n; i++) {
+              hashes[i] = key_hashes != NULL ? key_hashes[beg+i] : keys[beg+i].hash();
+              __builtin_prefetch(filter->blockOf(hashes[i]));
+            }
+          } else {
+            for(uint32_t i=0; i < n; i++) {
+              hashes[i] = key_hashes != NULL ? key_hashes[beg+i] : keys[beg+i].hash();
+            }
+          }
+          
+          uint32_t active = 0;
+          for(uint32_t i=0; i < n; i++) {
+            const uint32_t slot = hashes[i] & (slotCount()-1);
+            if(filter != NULL && ! filter->mayContain(hashes[i])) {
+              lists[i] = 0; // 確実に存在しない
+              nodes[i] = NULL;
+            } else if(isSubNode(slot)) {
+              nodes[i] = alc.ptr<Node>(slots_[slot]);
+              __builtin_prefetch(nodes[i]);
+              active++;
+            } else {
+              lists[i] = slots_[slot];
+              if(lists[i] != 0) {
+                __builtin_prefetch(alc.ptr<Cons>(lists[i]));
+              }
+              nodes[i] = NULL;
+            }
+          }
+
+          for(uint32_t level=directory_bits_/4; active > 0; level++) {
+            active = 0;
+            for(uint32_t i=0; i < n; i++) {
+              if(nodes[i] == NULL) {
+                continue;
+              }
+              
+              const uint32_t idx = Node::nthIndex(hashes[i], level);
+              if(nodes[i]->isSubNode(idx)) {
+                nodes[i] = nodes[i]->getSubNode(alc, idx);
+                __builtin_prefetch(nodes[i]);
+                active++;
+              } else {
+                lists[i] = nodes[i]->getList(alc, idx);
+                if(lists[i] != 0) {
+                  __builtin_prefetch(alc.ptr<Cons>(lists[i]));
+                }
+                nodes[i] = NULL;
+              }
+            }
+          }
+
+          for(uint32_t i=0; i < n; i++) {
+            results[beg+i] = List::find(lists[i], keys[beg+i], hashes[i], alc);
+          }
+        }
       }
-      
-      md_t resize(Alc & alc) {
-        md_t new_root_node = alc.ptr<Node>(root_)->resize(alc, root_depth_, root_depth_+1);
-        assert(new_root_node != 0);
 
-        md_t new_root = alc.allocate(sizeof(RootNode));
+      // left と right を合わせたテーブルのrootを新たに作る。(left と right はそのまま残る)
+      // 両方に存在するキーの値は policy に従って選ぶ。
+      static md_t merge(md_t left, md_t right, MergePolicy policy, const ResizePolicy & resize_policy, Alc & alc) {
+        const RootNode * l = alc.ptr<RootNode>(left);
+        const RootNode * r = alc.ptr<RootNode>(right);
+        assert(l->directory_bits_ == r->directory_bits_);
+
+        md_t new_root = alc.allocate(sizeOf(l->directory_bits_));
         assert(new_root != 0);
 
-        new (alc.ptr<RootNode>(new_root)) RootNode(count_, next_resize_trigger_*16, root_depth_+1, new_root_node);
+        RootNode * node = alc.ptr<RootNode>(new_root);
+        memset(static_cast<void*>(node), 0, sizeOf(l->directory_bits_));
+        node->directory_bits_ = l->directory_bits_;
+        node->stats_ = l->stats_;
+        node->stats_.add(r->stats_);
+        
+        Stats removed;
+        for(uint32_t i=0; i < node->slotCount(); i++) {
+          bool is_sub;
+          node->slots_[i] = Node::mergeSlot(l->slots_[i], l->isSubNode(i), r->slots_[i], r->isSubNode(i),
+                                            node->directory_bits_/4 - 1, policy, resize_policy, removed, is_sub, alc);
+          node->setSubNodeFlag(i, is_sub);
+          node->buckets_ += Node::slotBuckets(node->slots_[i], is_sub, alc);
+        }
+        node->stats_.sub(removed);
+        node->count_ = node->stats_.count;
+
+        // left のフィルタを引き継ぎ、right のキーを追加する
+        if(l->filter_ != 0) {
+          bool dup_rlt = alc.dup(l->filter_);
+          assert(dup_rlt != false);
+          node->filter_ = l->filter_;
+          
+          FilterAdder adder(alc.ptr<BloomFilter>(node->filter_));
+          for(uint32_t i=0; i < r->slotCount(); i++) {
+            Node::eachEntryInSlot(r->slots_[i], r->isSubNode(i), adder, alc);
+          }
+          node->updateFilterIfNeed(resize_policy, alc);
+        }
+
+        // 索引はキーの集合なので、小さい方の索引のキーを大きい方の索引に加える
+        if(resize_policy.ordered_index) {
+          const RootNode * small = l->count_ < r->count_ ? l : r;
+          const RootNode * large = small == l ? r : l;
+          IndexAdder adder(OrderedIndex::share(large->index_, alc), alc);
+          OrderedIndex::scanRange(small->index_, String(), String::invalid(), adder, alc);
+          node->index_ = adder.index;
+        }
         
         return new_root;
       }
 
+      // source のエントリから、公開されていない新しいテーブルのrootを組み立てる。
+      // キー毎に store() で経路をコピーする代わりに、各リストとノードを一度ずつ作るので、大量のエントリを一度に読み込む場合に速い。
+      // source は empty(), front() (const BulkEntry& を返す), pop() を持ち、エントリを trieOrder() の順に返すもの。
+      // count_hint はエントリ数の見込みで、平均リスト長が policy.average_chain 以下になる段までノードを作る。
+      // エントリが順序通りに並んでいなかった場合は、組み立てたものを解放して 0 を返す。(残りのエントリは取り出さない)
+      // source 内でキーが重複している場合は、後に取り出したものが残る。
+      template <class Source>
+      static md_t build(Source & source, uint64_t count_hint, const ResizePolicy & policy, Alc & alc) {
+        md_t root = create(policy, alc);
+        assert(root != 0);
+
+        RootNode * node = alc.ptr<RootNode>(root);
+        const uint32_t leaf_level = leafLevel(count_hint, policy);
+        node->buckets_ = 0;
+        for(uint32_t i=0; i < node->slotCount(); i++) {
+          const uint32_t slot = node->slotInOrder(i);
+          bool is_sub;
+          node->slots_[slot] = Node::buildSlot(source, slot, node->directory_bits_/4 - 1, leaf_level, policy,
+                                               is_sub, node->stats_, node->buckets_, alc);
+          node->setSubNodeFlag(slot, is_sub);
+        }
+        node->count_ = node->stats_.count;
+
+        if(! source.empty()) {
+          releaseNode(root, alc);
+          return 0;
+        }
+
+        if(node->filter_ != 0) {
+          if(node->count_ > alc.ptr<BloomFilter>(node->filter_)->capacity()) {
+            node->updateFilterIfNeed(policy, alc); // 全てのキーを登録したフィルタが作り直される
+          } else {
+            FilterAdder adder(alc.ptr<BloomFilter>(node->filter_));
+            node->eachEntry(adder, alc);
+          }
+        }
+
+        if(policy.ordered_index) {
+          KeyCollector collector(alc);
+          node->eachEntry(collector, alc);
+          node->index_ = OrderedIndex::build(collector.keys, alc);
+        }
+        return root;
+      }
+
+      // トライを辿る順序(ハッシュ値を下位の4ビットから順に比べる順序)での大小を表す値を返す。
+      // (ハッシュ値の4ビット単位の並びを反転したもの。dump::Writer で書き出すエントリはこの順に並ぶ)
+      static uint32_t trieOrder(uint32_t hash) {
+        hash = ((hash >> 4) & 0x0F0F0F0F) | ((hash & 0x0F0F0F0F) << 4);
+        hash = ((hash >> 8) & 0x00FF00FF) | ((hash & 0x00FF00FF) << 8);
+        return (hash >> 16) | (hash << 16);
+      }
+
+      // 全てのエントリを trieOrder() の順に callback(const Entry&) に渡す。(同じハッシュ値のエントリ同士の順序は不定)
+      // リストは辿る順に並んでいるので、並べ替えは各リストの中でのみ行う。
+      template <class Callback>
+      void eachEntryInOrder(Callback & callback, const Alc & alc) const {
+        ListSorter<Callback> sorter(callback, alc);
+        for(uint32_t i=0; i < slotCount(); i++) {
+          const uint32_t slot = slotInOrder(i);
+          Node::eachListInSlot(slots_[slot], isSubNode(slot), sorter, alc);
+        }
+      }
+
+      bool hasIndex() const { return index_ != 0; }
+
+      // 全てのエントリを callback(const Entry&) に渡す。(大きなエントリはレコードの記述子を持つものが渡されるので、body() から読むこと)
+      template <class Callback>
+      void eachEntry(Callback & callback, const Alc & alc) const {
+        for(uint32_t i=0; i < slotCount(); i++) {
+          Node::eachEntryInSlot(slots_[i], isSubNode(i), callback, alc);
+        }
+      }
+
+      // prefix で始まるキー、または begin 以上 end 未満のキーを辞書順に callback(key, hash) に渡す。(OrderedIndex を参照)
+      // NOTE: 索引からは期限切れのエントリが取り除かれるまでのキーも列挙される
+      template <class Callback>
+      void scanPrefix(const String & prefix, Callback & callback, const Alc & alc) const {
+        OrderedIndex::scanPrefix(index_, prefix, callback, alc);
+      }
+
+      template <class Callback>
+      void scanRange(const String & begin, const String & end, Callback & callback, const Alc & alc) const {
+        OrderedIndex::scanRange(index_, begin, end, callback, alc);
+      }
+
       template <class Callback>
       static void foreach(md_t root, Callback & callback, const Alc & alc) {
         RootNode * node = alc.ptr<RootNode>(root);
-        node->foreach(callback, alc);
+        node->foreachLive(Entry::now(), callback, alc);
       }
 
     private:
+      // 時刻 now の時点で期限切れのエントリは callback に渡さない
       template <class Callback>
-      void foreach(Callback & callback, const Alc & alc) {
-        alc.ptr<Node>(root_)->foreach(callback, root_depth_, alc);
+      void foreachLive(uint32_t now, Callback & callback, const Alc & alc) {
+        for(uint32_t i=0; i < slotCount(); i++) {
+          Node::foreachSlot(slots_[i], isSubNode(i), now, callback, alc);
+        }
       }      
       
     private:
-      md_t store(const String & key, const String & value, Alc & alc) {
-        bool new_key;
-        md_t new_node = alc.ptr<Node>(root_)->store(key, value, key.hash(), root_depth_, new_key, alc);
-        assert(new_node != 0);
+      md_t store(const String & key, const String & value, uint32_t hash, const ResizePolicy & policy, Change change, Alc & alc) {
+        // 平均リスト長が目標値を越えている間は、目標値より長いリストも分割の対象にする
+        const bool over_average = count_ > static_cast<uint64_t>(policy.average_chain) * buckets_;
+
+        const uint32_t slot = hash & (slotCount()-1);
+        bool is_sub = isSubNode(slot);
+
+        std::vector<String> dropped;
+        if(policy.ordered_index) {
+          change.dropped = &dropped;
+        }
         
-        md_t new_root = alc.allocate(sizeof(RootNode));
+        md_t new_slot = Node::storeSlot(slots_[slot], is_sub, key, value, hash, directory_bits_/4 - 1, policy, over_average, change, alc);
+        
+        md_t new_root = alc.allocate(sizeOf(directory_bits_));
         assert(new_root != 0);
 
-        uint32_t new_count = (new_key ? count_+1 : count_);
-        new (alc.ptr<RootNode>(new_root)) RootNode(new_count, next_resize_trigger_, root_depth_, new_node);
+        // ディレクトリごとコピーして、更新されたスロットのみを置き換える
+        RootNode * node = alc.ptr<RootNode>(new_root);
+        copyTo(node, slot, alc);
+        node->slots_[slot] = new_slot;
+        node->setSubNodeFlag(slot, is_sub);
+        node->count_ = count_ + change.added.count - change.removed.count;
+        node->buckets_ += change.buckets;
+        node->stats_.add(change.added);
+        node->stats_.sub(change.removed);
+
+        if(filter_ != 0) {
+          alc.ptr<BloomFilter>(filter_)->add(hash);
+          node->updateFilterIfNeed(policy, alc);
+        }
+
+        if(policy.ordered_index) {
+          node->replaceIndex(OrderedIndex::insert(index_, key, hash, alc), alc);
+          node->removeFromIndex(dropped, alc);
+        }
 
         return new_root;
       }
 
-    private:
-      RootNode(uint32_t count, uint32_t next_resize_trigger, uint32_t root_depth, md_t root)
-        : count_(count),
-          next_resize_trigger_(next_resize_trigger),
-          root_depth_(root_depth),
-          root_(root)
-      {
+      template <class Rewriter>
+      md_t rewrite(uint32_t hash, Rewriter & rewriter, Change & change, Alc & alc) {
+        const uint32_t slot = hash & (slotCount()-1);
+        const bool is_sub = isSubNode(slot);
+
+        std::vector<String> dropped;
+        if(index_ != 0) {
+          change.dropped = &dropped;
+        }
+        
+        md_t new_slot = Node::rewriteSlot(slots_[slot], is_sub, hash, directory_bits_/4 - 1, rewriter, change, alc);
+        
+        md_t new_root = alc.allocate(sizeOf(directory_bits_));
+        assert(new_root != 0);
+
+        // フィルタからは削除できないので、そのまま共有する (取り除かれたキーは偽陽性になるだけ)
+        RootNode * node = alc.ptr<RootNode>(new_root);
+        copyTo(node, slot, alc);
+        node->slots_[slot] = new_slot;
+        node->count_ = count_ + change.added.count - change.removed.count;
+        node->stats_.add(change.added);
+        node->stats_.sub(change.removed);
+        node->removeFromIndex(dropped, alc);
+        change.dropped = NULL;
+        return new_root;
+      }
+
+      // 期限切れのエントリを取り除く Rewriter
+      struct ExpiredRemover {
+        ExpiredRemover(uint32_t now) : now(now) {}
+        md_t operator()(md_t list, Change & change, Alc & alc) { return List::removeExpired(list, now, change, alc); }
+        uint32_t now;
+      };
+
+      // 追い出しの対象のエントリを取り除く Rewriter
+      struct ColdRemover {
+        ColdRemover(uint32_t now, ClockTable * clock) : now(now), clock(clock) {}
+        md_t operator()(md_t list, Change & change, Alc & alc) { return List::removeCold(list, now, clock, change, alc); }
+        uint32_t now;
+        ClockTable * clock;
+      };
+
+      // ハッシュ値のビット列を反転する。(スイープのカーソルはリストを下位ビットから順に辿れるように反転した空間で進める)
+      static uint32_t reverseBits(uint32_t v) {
+        v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+        v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+        v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+        return (v >> 16) | (v << 16);
+      }
+
+      struct FilterAdder {
+        FilterAdder(BloomFilter * filter) : filter(filter) {}
+        void operator()(const Entry & e) { filter->add(e.hash); }
+        BloomFilter * filter;
+      };
+
+      struct IndexAdder {
+        IndexAdder(md_t index, Alc & alc) : index(index), alc(alc) {}
+        void operator()(const String & key, uint32_t hash) {
+          md_t new_index = OrderedIndex::insert(index, key, hash, alc);
+          OrderedIndex::release(index, alc);
+          index = new_index;
+        }
+        md_t index;
+        Alc & alc;
+      };
+
+      struct KeyCollector {
+        KeyCollector(const Alc & alc) : alc(alc) {}
+        void operator()(const Entry & e) { keys.push_back(std::make_pair(e.body(alc)->key(), e.hash)); }
+        const Alc & alc;
+        std::vector<std::pair<String, uint32_t> > keys;
+      };
+
+      // 各リストのエントリを trieOrder() の順に並べ替えてから callback に渡す
+      template <class Callback>
+      struct ListSorter {
+        ListSorter(Callback & callback, const Alc & alc) : callback(callback), alc(alc) {}
+
+        void operator()(md_t list) {
+          entries.clear();
+          for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+            const Cons * c = alc.ptr<Cons>(list);
+            for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+              entries.push_back(std::make_pair(trieOrder(e->hash), e));
+            }
+          }
+          std::sort(entries.begin(), entries.end(), lessOrder);
+          for(size_t i=0; i < entries.size(); i++) {
+            callback(*entries[i].second);
+          }
+        }
+
+        static bool lessOrder(const std::pair<uint32_t, const Entry*> & a, const std::pair<uint32_t, const Entry*> & b) {
+          return a.first < b.first;
+        }
+
+        Callback & callback;
+        const Alc & alc;
+        std::vector<std::pair<uint32_t, const Entry*> > entries;
+      };
+
+      // ディレクトリの i 番目に辿るスロット。(ディレクトリが複数段分の場合は、下位の4ビットの方を先に比べる)
+      uint32_t slotInOrder(uint32_t i) const {
+        return trieOrder(i << (32 - directory_bits_));
+      }
+
+      // エントリ数 count のテーブルを組み立てる時に、リストを置く段 (平均リスト長が average_chain 以下になる最初の段)
+      static uint32_t leafLevel(uint64_t count, const ResizePolicy & policy) {
+        const uint64_t chain = policy.average_chain == 0 ? 1 : policy.average_chain;
+        uint32_t level = policy.directory_bits/4 - 1;
+        for(uint64_t buckets = 1ULL << policy.directory_bits; buckets * chain < count && level+1 < Node::MAX_LEVEL; buckets *= 16) {
+          level++;
+        }
+        return level;
+      }
+
+      // このrootを(skip 番目以外のスロットも含めて)新しいrootの領域 node にコピーする。
+      // コピーしたスロット、フィルタ、索引は両方のrootから参照されるので、それぞれの参照カウントを増やす。
+      // (skip 番目のスロットは呼び出し側が置き換える)
+      void copyTo(RootNode * node, uint32_t skip, Alc & alc) const {
+        memcpy(static_cast<void*>(node), this, sizeOf(directory_bits_));
+        node->retired_next_ = 0;
+        for(uint32_t i=0; i < slotCount(); i++) {
+          if(i != skip) {
+            Node::share(slots_[i], alc);
+          }
+        }
+        Node::share(filter_, alc);
+        OrderedIndex::share(index_, alc);
+      }
+
+      // 索引を index に置き換える。(index の参照は引き継ぎ、元の索引の参照は解放する)
+      void replaceIndex(md_t index, Alc & alc) {
+        OrderedIndex::release(index_, alc);
+        index_ = index;
+      }
+
+      // 期限切れや追い出しで取り除いたエントリのキーを索引からも除く
+      void removeFromIndex(const std::vector<String> & keys, Alc & alc) {
+        for(size_t i=0; i < keys.size(); i++) {
+          replaceIndex(OrderedIndex::remove(index_, keys[i], alc), alc);
+        }
+      }
+      
+      // エントリ数がフィルタの容量を越えた場合は、倍の容量のフィルタを作り直す。(コストはエントリ数に比例する)
+      // hash を含むリストを書き換える際に(レコード、Blob、フィルタ以外で)割り当てうるバイト数の上限。
+      // extra はリストに加わるエントリ数。索引から取り除くキーは、all_dropped なら全てのエントリ、そうでなければ時刻 now の時点で期限切れのエントリとみなす。
+      uint64_t rewriteBound(uint32_t hash, uint32_t extra, bool all_dropped, uint32_t now, const Alc & alc) const {
+        const uint32_t slot = hash & (slotCount()-1);
+        uint32_t bits;
+        md_t list = Node::listOf(slots_[slot], isSubNode(slot), hash, directory_bits_/4 - 1, bits, alc);
+
+        // リストは作り直した上で分割されることがあるので、セルを二度割り当てる分を見込む
+        uint64_t bound = Alc::blockSize(sizeOf(directory_bits_)) +
+                         (Node::MAX_LEVEL + 1) * Alc::blockSize(sizeof(Node)) +
+                         2 * static_cast<uint64_t>(List::length(list, alc) + extra) * Alc::blockSize(sizeof(Cons) + Cons::PACK_SIZE);
+        if(index_ != 0) {
+          for(; list != 0; list = alc.ptr<Cons>(list)->cdr()) {
+            const Cons * c = alc.ptr<Cons>(list);
+            for(const Entry * e = c->begin(); e != c->end(); e = Cons::next(e)) {
+              if(all_dropped || e->isExpired(now, alc)) {
+                bound += OrderedIndex::pathBound(index_, e->body(alc)->key(), alc);
+              }
+            }
+          }
+        }
+        return bound;
+      }
+
+      void updateFilterIfNeed(const ResizePolicy & policy, Alc & alc) {
+        if(count_ <= alc.ptr<BloomFilter>(filter_)->capacity() || policy.filter_bits_per_key == 0) {
+          return;
+        }
+
+        md_t new_filter = BloomFilter::create(count_ * 2, policy.filter_bits_per_key, alc);
+        FilterAdder adder(alc.ptr<BloomFilter>(new_filter));
+        for(uint32_t i=0; i < slotCount(); i++) {
+          Node::eachEntryInSlot(slots_[i], isSubNode(i), adder, alc);
+        }
+        
+        alc.release(filter_);
+        filter_ = new_filter;
+      }
+
+      uint32_t slotCount() const { return 1 << directory_bits_; }
+      
+      static uint32_t maskWords(uint32_t directory_bits) {
+        return ((1 << directory_bits) + 31) / 32;
+      }
+
+      // サブノードかどうかのビットマスクはディレクトリの直後に置かれる
+      const uint32_t * subMask() const { return reinterpret_cast<const uint32_t*>(slots_ + slotCount()); }
+      uint32_t * subMask() { return reinterpret_cast<uint32_t*>(slots_ + slotCount()); }
+      
+      bool isSubNode(uint32_t index) const {
+        return subMask()[index / 32] & (1 << (index % 32));
+      }
+
+      void setSubNodeFlag(uint32_t index, bool is_sub) {
+        if(is_sub) {
+          subMask()[index / 32] |= 1 << (index % 32);
+        } else {
+          subMask()[index / 32] &= ~(1 << (index % 32));
+        }
       }
 
     private:
-      const uint32_t count_;
-      const uint32_t next_resize_trigger_;
-      const uint32_t root_depth_;
-      const md_t root_;
+      uint32_t count_;
+      uint32_t directory_bits_;
+      uint32_t buckets_; // テーブル全体のリスト(バケット)の数 (空のものも含む)
+      md_t filter_;      // 全てのキーを登録したBloomフィルタ (使わない場合は 0)
+      md_t index_;       // 全てのキーを辞書順に並べた索引 (使わない場合や空の場合は 0)
+      md_t retired_next_; // 保留中の次のroot (retiredNext()を参照)
+      Stats stats_;      // テーブル全体の集計値
+      md_t slots_[0];    // ディレクトリ (2^directory_bits 個のスロット)
     };
   }
 }
@@ -0,0 +1,357 @@
+#ifndef __IHT_TRIE_ORDERED_INDEX_HH__
+#define __IHT_TRIE_ORDERED_INDEX_HH__
+
+#include "../allocator/fixed_allocator.hh"
+#include "../string.hh"
+#include <inttypes.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace iht {
+  namespace trie {
+    // キーを辞書順に並べた永続的な crit-bit 木。(ハッシュトライと同じ共有メモリ上に置かれ、RootNode から参照される)
+    // 更新は根から挿入(削除)位置までの経路のみをコピーして新しい根を作るので、古い根を参照している読み込み側には影響しない。
+    // 経路以外の部分木は新旧の木で共有されるので、各ノードと葉は参照カウントで管理する。(親から子への参照を一つと数える)
+    // 前方一致や範囲での列挙は、O(木の深さ + 列挙する数) で済む。
+    //
+    // キーは任意のバイト列なので、各バイトを「存在ビット + 8ビット」の9ビットの記号として扱う。
+    // (キーの末尾より後ろは 0 とみなすので、短いキーが長いキーより前に並び、"a" と "a\0" も区別できる)
+    class OrderedIndex {
+      typedef uint32_t md_t;
+      typedef allocator::FixedAllocator Alc;
+
+      static const uint32_t LEAF = 0xFFFFFFFF;
+      static const uint32_t SYMBOL_MASK = 0x1FF;
+
+      // 分岐ノード。byte バイト目の記号のうち ~otherbits のビットで子を選ぶ
+      struct Node {
+        uint32_t byte; // 葉の場合は LEAF
+        uint32_t otherbits;
+        md_t child[2];
+      };
+
+      struct Leaf {
+        uint32_t mark; // 常に LEAF
+        uint32_t hash; // キーのハッシュ値 (値はハッシュトライから、このハッシュ値で引く)
+        uint32_t size;
+        char key[0];
+
+        String str() const { return String(key, size); }
+      };
+
+    public:
+      // key を加えた木の根を返す。(既に含まれている場合は root をそのまま返す)
+      // 返した根は新たな参照を持つので、不要になったら release() で解放する。(root の参照はそのまま残る)
+      static md_t insert(md_t root, const String & key, uint32_t hash, Alc & alc) {
+        if(root == 0) {
+          return createLeaf(key, hash, alc);
+        }
+
+        // key と最も長く一致する葉を探して、最初に異なるビットの位置を求める
+        md_t p = root;
+        while(! isLeaf(p, alc)) {
+          const Node * n = alc.ptr<Node>(p);
+          p = n->child[direction(n, key)];
+        }
+        const String leaf_key = alc.ptr<Leaf>(p)->str();
+
+        uint32_t byte, otherbits;
+        if(! firstDifference(key, leaf_key, byte, otherbits)) {
+          return share(root, alc);
+        }
+        const uint32_t leaf_dir = (1 + (otherbits | symbol(leaf_key, byte))) >> 9;
+
+        return insertAt(root, key, byte, otherbits, leaf_dir, createLeaf(key, hash, alc), alc);
+      }
+
+      // key を除いた木の根を返す。(含まれていない場合は root をそのまま返す。参照の扱いは insert() と同様)
+      static md_t remove(md_t root, const String & key, Alc & alc) {
+        if(root == 0) {
+          return 0;
+        }
+
+        bool found = false;
+        md_t new_root = removeAt(root, key, found, alc);
+        return found ? new_root : share(root, alc);
+      }
+
+      // 既存の木(部分木)を新たに参照するために、参照カウントを増やして返す。(0 ならそのまま)
+      static md_t share(md_t root, Alc & alc) {
+        if(root != 0) {
+          bool dup_rlt = alc.dup(root);
+          assert(dup_rlt != false);
+        }
+        return root;
+      }
+
+      // 木の参照を解放する。最後の参照だった場合は、他の木と共有していない子も再帰的に解放する。(0 なら何もしない)
+      static void release(md_t root, Alc & alc) {
+        if(root == 0 || ! alc.undup(root)) {
+          return;
+        }
+        if(! isLeaf(root, alc)) {
+          const Node * n = alc.ptr<Node>(root);
+          release(n->child[0], alc);
+          release(n->child[1], alc);
+        }
+        alc.release_no_undup(root);
+      }
+
+      // insert() または remove() で key の経路をコピーするのに割り当てるバイト数の上限
+      static uint64_t pathBound(md_t root, const String & key, const Alc & alc) {
+        uint64_t depth = 0;
+        for(md_t p = root; p != 0 && ! isLeaf(p, alc); depth++) {
+          const Node * n = alc.ptr<Node>(p);
+          p = n->child[direction(n, key)];
+        }
+        return (depth + 1) * Alc::blockSize(sizeof(Node)) + Alc::blockSize(sizeof(Leaf) + key.size());
+      }
+
+      // keys (キーとハッシュ値の組。キーは重複してはいけない) の木を組み立てて、その根を返す。(keys は辞書順に並べ替えられる)
+      // insert() を繰り返した場合と同じ木になるが、経路のコピーを伴わないので、割り当てるのは葉と分岐ノードの分のみで済む。
+      static md_t build(std::vector<std::pair<String, uint32_t> > & keys, Alc & alc) {
+        if(keys.empty()) {
+          return 0;
+        }
+        std::sort(keys.begin(), keys.end(), lessKey);
+        return buildRange(keys, 0, keys.size(), alc);
+      }
+
+      // prefix で始まる全てのキーを、辞書順に callback(key, hash) に渡す
+      template <class Callback>
+      static void scanPrefix(md_t root, const String & prefix, Callback & callback, const Alc & alc) {
+        if(root == 0) {
+          return;
+        }
+
+        // 分岐位置が prefix の範囲内にある間は辿り、prefix を越えた最初の部分木を列挙の対象とする
+        md_t top = root;
+        md_t p = root;
+        while(! isLeaf(p, alc)) {
+          const Node * n = alc.ptr<Node>(p);
+          p = n->child[direction(n, prefix)];
+          if(n->byte < prefix.size()) {
+            top = p;
+          }
+        }
+
+        const String k = alc.ptr<Leaf>(p)->str();
+        if(k.size() < prefix.size() || memcmp(k.data(), prefix.data(), prefix.size()) != 0) {
+          return;
+        }
+
+        std::vector<md_t> pending;
+        for(md_t next = top; next != 0; next = pop(pending)) {
+          const Leaf * leaf = leftmost(next, pending, alc);
+          callback(leaf->str(), leaf->hash);
+        }
+      }
+
+      // begin 以上 end 未満のキーを、辞書順に callback(key, hash) に渡す。(end が String::invalid() の場合は上限なし)
+      template <class Callback>
+      static void scanRange(md_t root, const String & begin, const String & end, Callback & callback, const Alc & alc) {
+        if(root == 0) {
+          return;
+        }
+
+        // begin と最も長く一致する葉と begin が最初に異なる位置を求める
+        md_t p = root;
+        while(! isLeaf(p, alc)) {
+          const Node * n = alc.ptr<Node>(p);
+          p = n->child[direction(n, begin)];
+        }
+        const String leaf_key = alc.ptr<Leaf>(p)->str();
+        uint32_t byte = LEAF, otherbits = 0;
+        const bool differs = firstDifference(begin, leaf_key, byte, otherbits);
+
+        // その位置より手前で分岐する間だけ begin に沿って辿る。
+        // 辿り着いた部分木のキーは全て、その位置までは葉のキーと一致するので、begin との大小も葉のキーと同じになる。
+        // (右側の兄弟は、後で辿るために pending に積んでおく)
+        std::vector<md_t> pending;
+        p = root;
+        while(! isLeaf(p, alc) && before(alc.ptr<Node>(p), byte, otherbits)) {
+          const Node * n = alc.ptr<Node>(p);
+          const uint32_t dir = direction(n, begin);
+          if(dir == 0) {
+            pending.push_back(n->child[1]);
+          }
+          p = n->child[dir];
+        }
+        if(differs && symbol(leaf_key, byte) < symbol(begin, byte)) {
+          p = pop(pending); // 部分木全体が begin より前
+        }
+
+        const bool bounded = end.data() != String::invalid().data();
+        for(; p != 0; p = pop(pending)) {
+          const Leaf * leaf = leftmost(p, pending, alc);
+          if(bounded && compare(leaf->str(), end) >= 0) {
+            return;
+          }
+          callback(leaf->str(), leaf->hash);
+        }
+      }
+
+    private:
+      static bool isLeaf(md_t md, const Alc & alc) { return alc.ptr<Node>(md)->byte == LEAF; }
+
+      static uint32_t symbol(const String & key, uint32_t byte) {
+        return byte < key.size() ? 0x100 | static_cast<unsigned char>(key.data()[byte]) : 0;
+      }
+
+      static uint32_t direction(const Node * n, const String & key) {
+        return (1 + (n->otherbits | symbol(key, n->byte))) >> 9;
+      }
+
+      // 分岐ノード n の分岐位置が (byte, otherbits) より手前かどうか
+      // (同じバイト内では上位ビットほど手前で、上位ビットほど otherbits は小さくなる)
+      static bool before(const Node * n, uint32_t byte, uint32_t otherbits) {
+        return n->byte < byte || (n->byte == byte && n->otherbits < otherbits);
+      }
+
+      // a と b が最初に異なる記号の位置とビットを求める。(等しい場合は false を返す)
+      static bool firstDifference(const String & a, const String & b, uint32_t & byte, uint32_t & otherbits) {
+        const uint32_t size = std::max(a.size(), b.size());
+        for(byte = 0; byte < size; byte++) {
+          uint32_t x = symbol(a, byte) ^ symbol(b, byte);
+          if(x != 0) {
+            while(x & (x-1)) {
+              x &= x-1; // 最上位のビットのみを残す
+            }
+            otherbits = x ^ SYMBOL_MASK;
+            return true;
+          }
+        }
+        return false;
+      }
+
+      static int compare(const String & a, const String & b) {
+        int ret = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+        if(ret != 0) {
+          return ret;
+        }
+        return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+      }
+
+      static bool lessKey(const std::pair<String, uint32_t> & a, const std::pair<String, uint32_t> & b) {
+        return compare(a.first, b.first) < 0;
+      }
+
+      // 辞書順に並んだ keys の [beg, end) の部分木を作る。
+      // 部分木の根の分岐位置は、範囲の最初と最後のキーが最初に異なる位置で、その位置の方向が 1 になる最初のキーで左右に分かれる。
+      static md_t buildRange(const std::vector<std::pair<String, uint32_t> > & keys, size_t beg, size_t end, Alc & alc) {
+        if(end - beg == 1) {
+          return createLeaf(keys[beg].first, keys[beg].second, alc);
+        }
+
+        Node branch;
+        bool differs = firstDifference(keys[beg].first, keys[end-1].first, branch.byte, branch.otherbits);
+        assert(differs);
+
+        size_t lo = beg+1, hi = end-1; // 右側の最初のキーを二分探索する
+        while(lo < hi) {
+          const size_t mid = lo + (hi - lo) / 2;
+          if(direction(&branch, keys[mid].first) == 0) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        branch.child[0] = buildRange(keys, beg, lo, alc);
+        branch.child[1] = buildRange(keys, lo, end, alc);
+
+        md_t md = alc.allocate(sizeof(Node));
+        assert(md != 0);
+        *alc.ptr<Node>(md) = branch;
+        return md;
+      }
+
+      // p の部分木の最も左の葉を返す。(途中で辿らなかった右の子は pending に積む)
+      static const Leaf * leftmost(md_t p, std::vector<md_t> & pending, const Alc & alc) {
+        while(! isLeaf(p, alc)) {
+          const Node * n = alc.ptr<Node>(p);
+          pending.push_back(n->child[1]);
+          p = n->child[0];
+        }
+        return alc.ptr<Leaf>(p);
+      }
+
+      static md_t pop(std::vector<md_t> & pending) {
+        if(pending.empty()) {
+          return 0;
+        }
+        md_t md = pending.back();
+        pending.pop_back();
+        return md;
+      }
+
+      static md_t createLeaf(const String & key, uint32_t hash, Alc & alc) {
+        md_t md = alc.allocate(sizeof(Leaf) + key.size());
+        assert(md != 0);
+
+        Leaf * leaf = alc.ptr<Leaf>(md);
+        leaf->mark = LEAF;
+        leaf->hash = hash;
+        leaf->size = key.size();
+        memcpy(leaf->key, key.data(), key.size());
+        return md;
+      }
+
+      static md_t insertAt(md_t md, const String & key, uint32_t byte, uint32_t otherbits, uint32_t leaf_dir, md_t leaf,
+                           Alc & alc) {
+        if(isLeaf(md, alc) || ! before(alc.ptr<Node>(md), byte, otherbits)) {
+          // ここに新しい分岐を挟む
+          md_t new_md = alc.allocate(sizeof(Node));
+          assert(new_md != 0);
+          Node * n = alc.ptr<Node>(new_md);
+          n->byte = byte;
+          n->otherbits = otherbits;
+          n->child[leaf_dir] = share(md, alc);
+          n->child[1-leaf_dir] = leaf;
+          return new_md;
+        }
+
+        const Node * old = alc.ptr<Node>(md);
+        const uint32_t dir = direction(old, key);
+        md_t child = insertAt(old->child[dir], key, byte, otherbits, leaf_dir, leaf, alc);
+
+        md_t new_md = alc.allocate(sizeof(Node));
+        assert(new_md != 0);
+        Node * n = alc.ptr<Node>(new_md);
+        *n = *old;
+        n->child[dir] = child;
+        share(old->child[1-dir], alc);
+        return new_md;
+      }
+
+      // 削除した葉の親は、残った兄弟で置き換える。(見つからなかった場合の返り値は使われないので、参照を持たない)
+      static md_t removeAt(md_t md, const String & key, bool & found, Alc & alc) {
+        if(isLeaf(md, alc)) {
+          found = alc.ptr<Leaf>(md)->str() == key;
+          return 0;
+        }
+
+        const Node * old = alc.ptr<Node>(md);
+        const uint32_t dir = direction(old, key);
+        md_t child = removeAt(old->child[dir], key, found, alc);
+        if(! found) {
+          return md;
+        }
+        if(child == 0) {
+          return share(old->child[1-dir], alc);
+        }
+
+        md_t new_md = alc.allocate(sizeof(Node));
+        assert(new_md != 0);
+        Node * n = alc.ptr<Node>(new_md);
+        *n = *old;
+        n->child[dir] = child;
+        share(old->child[1-dir], alc);
+        return new_md;
+      }
+    };
+  }
+}
+
+#endif
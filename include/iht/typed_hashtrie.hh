@@ -0,0 +1,111 @@
+#ifndef __IHT_TYPED_HASHTRIE_HH__
+#define __IHT_TYPED_HASHTRIE_HH__
+
+#include "hashtrie.hh"
+#include <inttypes.h>
+#include <string.h>
+
+namespace iht {
+  // TypedHashTrie で使うキーのハッシュ関数。
+  // 定義があるのは下の整数型のみ。それ以外の型のキーには、TypedHashTrie の H にハッシュ関数を指定する必要がある。
+  // (キーのバイト列をそのままハッシュすると、構造体の詰め物(パディング)の内容によって等しいキーのハッシュ値が異なり得るため)
+  template <class T>
+  struct Hash;
+
+  // 整数キー用のハッシュ関数。(MurmurHash3 の fmix64)
+  // トライの各段はハッシュ値の下位ビットから順に使うので、連番のキーでも下位ビットが偏らないように混ぜる。
+  struct IntegerHash {
+    uint32_t operator()(uint64_t key) const {
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdULL;
+      key ^= key >> 33;
+      key *= 0xc4ceb9fe1a85ec53ULL;
+      key ^= key >> 33;
+      return static_cast<uint32_t>(key);
+    }
+  };
+
+  template <> struct Hash<uint64_t> : IntegerHash {};
+  template <> struct Hash<int64_t>  : IntegerHash {};
+  template <> struct Hash<uint32_t> : IntegerHash {};
+  template <> struct Hash<int32_t>  : IntegerHash {};
+  template <> struct Hash<uint16_t> : IntegerHash {};
+  template <> struct Hash<int16_t>  : IntegerHash {};
+  template <> struct Hash<uint8_t>  : IntegerHash {};
+  template <> struct Hash<int8_t>   : IntegerHash {};
+
+  // キーと値の型を指定する HashTrie。
+  // K と V は固定長の POD 型で、そのバイト列がそのままエントリに(インラインで)格納される。
+  // 文字列への変換が不要で、ハッシュ値は H で求めたものになる。
+  // キーはバイト列で比較する。(8バイトと4バイトのキーは一回の整数比較。Entry::keyEquals() を参照)
+  //
+  // NOTE: キーはバイト列で比較するので、K は詰め物(パディング)を含まない型でなければならない
+  // NOTE: 内部の HashTrie には H で求めたハッシュ値で格納するので、同じテーブルを String のキーで操作してはいけない
+  template <class K, class V, class H=Hash<K> >
+  class TypedHashTrie {
+  public:
+    TypedHashTrie(size_t shm_size, const trie::ResizePolicy & resize_policy=trie::ResizePolicy(),
+                  atomic::Policy policy=atomic::MULTI_THREAD)
+      : trie_(shm_size, resize_policy, policy)
+    {
+    }
+
+    TypedHashTrie(size_t shm_size, const std::string & filepath, mode_t mode=0660,
+                  const trie::ResizePolicy & resize_policy=trie::ResizePolicy(),
+                  atomic::Policy policy=atomic::MULTI_THREAD)
+      : trie_(shm_size, filepath, mode, resize_policy, policy)
+    {
+    }
+
+    operator bool() const { return trie_; }
+
+    bool store(const K & key, const V & value) {
+      return trie_.store(bytes(key), bytes(value), H()(key));
+    }
+
+    size_t size() { return trie_.size(); }
+
+    HashTrie & getTrie() { return trie_; }
+
+    class View {
+    public:
+      View(TypedHashTrie & trie, uint32_t cache_bits=0)
+        : view_(trie.getTrie(), cache_bits)
+      {
+      }
+
+      // key が存在すれば、その値を value に格納して true を返す。
+      bool find(const K & key, V & value) const {
+        String s = view_.find(bytes(key), H()(key));
+        if(s.data() == String::invalid().data()) {
+          return false;
+        }
+        assert(s.size() == sizeof(V));
+        memcpy(&value, s.data(), sizeof(V));
+        return true;
+      }
+
+      bool member(const K & key) const {
+        return view_.find(bytes(key), H()(key)).data() != String::invalid().data();
+      }
+
+      size_t size() const { return view_.size(); }
+
+      void updateIfNeed() { view_.updateIfNeed(); }
+
+    private:
+      iht::View view_;
+    };
+
+  private:
+    template <class T>
+    static String bytes(const T & v) {
+      return String(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+  private:
+    HashTrie trie_;
+  };
+}
+
+#endif
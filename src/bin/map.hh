@@ -97,7 +97,8 @@ View * HashMap::createView() {
 
 class TrieMap : public Map {
 public:
-  TrieMap() : impl_(1024*1024*250) {
+  TrieMap(iht::atomic::Policy policy=iht::atomic::MULTI_THREAD)
+    : impl_(1024*1024*250, iht::trie::ResizePolicy(), policy) {
   }
   
   virtual void store(const std::string & key, const std::string & value) {
@@ -122,7 +123,10 @@ public:
   
   virtual size_t size() { return impl_.size(); }
   
-  virtual unsigned totalValueLength() { return 0; /* TODO */ }
+  virtual unsigned totalValueLength() {
+    iht::View v(impl_);
+    return v.stats().value_bytes;
+  }
 
   virtual View * createView();
   
@@ -155,19 +159,9 @@ public:
     return map_.size();
   }
 
-  struct Callback {
-    Callback() : sum(0) {}
-    void operator()(const iht::String & key, const iht::String & val) {
-      sum += val.size();
-    }
-    unsigned sum;
-  };
-  
   virtual unsigned totalValueLength() {
     v_.updateIfNeed();
-    Callback callback;
-    v_.foreach(callback);
-    return callback.sum;
+    return v_.stats().value_bytes;
   }
   
 private:
@@ -10,12 +10,23 @@ typedef std::vector<std::string> KeyList;
 
 enum MAPTYPE {
   MAPTYPE_HASH,
-  MAPTYPE_TRIE
+  MAPTYPE_TRIE,
+  MAPTYPE_TRIE_SINGLE  // ロック命令を使わない(atomic::SINGLE_THREAD)トライ
 };
 
+MAPTYPE parse_map_type(const char * name) {
+  if(strcmp(name, "hash") == 0) {
+    return MAPTYPE_HASH;
+  }
+  if(strcmp(name, "trie-single") == 0) {
+    return MAPTYPE_TRIE_SINGLE;
+  }
+  return MAPTYPE_TRIE;
+}
+
 struct Param {
   Param(char ** argv)
-    : map_type(strcmp(argv[1], "hash") == 0 ? MAPTYPE_HASH : MAPTYPE_TRIE),
+    : map_type(parse_map_type(argv[1])),
       write_op_num(atoi(argv[2])),
       read_op_num(atoi(argv[3])),
       sum_op_num(atoi(argv[4]))
@@ -45,7 +56,7 @@ void gen_input_data(KeyList & write_keys, KeyList & read_keys, const Param & par
 
 int main(int argc, char ** argv) {
   if(argc != 5) {
-    std::cerr << "Usage: st-bench MAPTYPE(hash|trie) WRITE_NUM READ_NUM SUM_NUM" << std::endl;
+    std::cerr << "Usage: st-bench MAPTYPE(hash|trie|trie-single) WRITE_NUM READ_NUM SUM_NUM" << std::endl;
     return 1;
   }
   
@@ -73,6 +84,7 @@ int main(int argc, char ** argv) {
   switch(param.map_type) {
   case MAPTYPE_HASH: map = new HashMap(); break;
   case MAPTYPE_TRIE: map = new TrieMap(); break;
+  case MAPTYPE_TRIE_SINGLE: map = new TrieMap(iht::atomic::SINGLE_THREAD); break;
   }
 
   double write_time;
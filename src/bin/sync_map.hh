@@ -209,7 +209,7 @@ View * RWLockMap::createView() {
 
 class PersistentMap : public Map {
 public:
-  PersistentMap() : impl_(1024*1024*250) {
+  PersistentMap() : impl_(1024*1024*250), views_(impl_) {
     int ret = pthread_mutex_init(&mtx_, NULL);
     assert(ret == 0);
   }
@@ -226,8 +226,7 @@ public:
   }
 
   virtual bool find(const std::string & key, std::string & value) {
-    iht::View v(impl_);
-    iht::String s = v.find(key);
+    iht::String s = views_.get().find(key);
     if(s) {
       value.assign(s.data(), s.size());
       return true;
@@ -237,13 +236,14 @@ public:
   }
 
   virtual bool member(const std::string & key) {
-    iht::View v(impl_);
-    return v.find(key);
+    return views_.get().find(key);
   }
   
   virtual size_t size() { return impl_.size(); }
   
-  virtual unsigned totalValueLength() { return 0; /* TODO */ }
+  virtual unsigned totalValueLength() {
+    return views_.get().stats().value_bytes;
+  }
 
   virtual View * createView();
   
@@ -252,6 +252,7 @@ public:
   
 private:
   iht::HashTrie impl_;
+  iht::ThreadView views_;
   pthread_mutex_t mtx_;
 };
 
@@ -277,19 +278,9 @@ public:
     return map_.size();
   }
 
-  struct Callback {
-    Callback() : sum(0) {}
-    void operator()(const iht::String & key, const iht::String & val) {
-      sum += val.size();
-    }
-    unsigned sum;
-  };
-  
   virtual unsigned totalValueLength() {
     v_.updateIfNeed();
-    Callback callback;
-    v_.foreach(callback);
-    return callback.sum;
+    return v_.stats().value_bytes;
   }
   
 private:
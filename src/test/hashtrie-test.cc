@@ -0,0 +1,982 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <iht/hashtrie.hh>
+#include <iht/frozen_table.hh>
+#include <iht/typed_hashtrie.hh>
+
+// make test で実行する、格納・検索・マージ・ダンプ/リストア・凍結の往復と、読み込み/書き込みの並行動作の確認。
+// 失敗した確認は標準エラーに出力し、一つでも失敗すれば終了コードを 1 にする。
+
+using iht::String;
+
+static int g_failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+void check(bool ok, const char * expr, const char * file, int line) {
+  if(! ok) {
+    std::cerr << "  FAILED: " << expr << " (" << file << ":" << line << ")" << std::endl;
+    g_failures++;
+  }
+}
+
+std::string key_of(unsigned i) {
+  char buf[32];
+  sprintf(buf, "key-%u", i);
+  return buf;
+}
+
+// インライン格納、Blob への分割格納の両方を通るように、値の長さを散らす
+std::string value_of(unsigned i, unsigned version=0) {
+  char buf[32];
+  sprintf(buf, "%u/%u:", i, version);
+  std::string value(buf);
+  value.resize(i % 100 == 0 ? 5000 : i % 7 == 0 ? 200 : 16 + i % 13, 'a' + (i + version) % 26);
+  return value;
+}
+
+bool equals(const String & s, const std::string & expected) {
+  return s.data() != String::invalid().data() && std::string(s.data(), s.size()) == expected;
+}
+
+// sample() や sketch() に渡す乱数生成器 (xorshift)
+struct Random {
+  Random() : state(2463534242u) {}
+  uint32_t operator()() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+  uint32_t state;
+};
+
+struct Collector {
+  std::map<std::string, std::string> entries;
+  void operator()(const String & key, const String & value) {
+    entries[std::string(key.data(), key.size())] = std::string(value.data(), value.size());
+  }
+};
+
+// 0 から count-1 までのキーが version の値で格納されているかどうか
+void check_contents(iht::View & view, unsigned count, unsigned version) {
+  CHECK(view.size() == count);
+  for(unsigned i=0; i < count; i++) {
+    CHECK(equals(view.find(key_of(i).c_str()), value_of(i, version)));
+  }
+  CHECK(view.find("no-such-key").data() == String::invalid().data());
+}
+
+void test_store_find() {
+  std::cout << "[store/find]" << std::endl;
+  const unsigned N = 20000;
+  iht::HashTrie trie(64 * 1024 * 1024);
+  CHECK(trie);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(trie.store(key_of(i).c_str(), value_of(i)));
+  }
+  CHECK(trie.size() == N);
+
+  // 上書き
+  for(unsigned i=0; i < N; i += 3) {
+    CHECK(trie.store(key_of(i).c_str(), value_of(i, 1)));
+  }
+  CHECK(trie.size() == N);
+
+  iht::View view(trie);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(equals(view.find(key_of(i).c_str()), value_of(i, i % 3 == 0 ? 1 : 0)));
+  }
+
+  std::vector<std::string> keys;
+  for(unsigned i=0; i < 100; i++) {
+    keys.push_back(key_of(i * 101));
+  }
+  keys.push_back("no-such-key");
+  std::vector<String> key_strs(keys.begin(), keys.end());
+  std::vector<String> results;
+  view.findMany(key_strs, results);
+  CHECK(results.size() == keys.size());
+  for(unsigned i=0; i < 100; i++) {
+    CHECK(equals(results[i], value_of(i * 101, (i * 101) % 3 == 0 ? 1 : 0)));
+  }
+  CHECK(results[100].data() == String::invalid().data());
+}
+
+void test_merge() {
+  std::cout << "[merge]" << std::endl;
+  const unsigned N = 5000;
+  for(int p=0; p < 2; p++) {
+    const iht::trie::MergePolicy policy = p == 0 ? iht::trie::PREFER_RIGHT : iht::trie::PREFER_LEFT;
+    iht::HashTrie trie(64 * 1024 * 1024);
+    for(unsigned i=0; i < N; i++) {
+      trie.store(key_of(i).c_str(), value_of(i));
+    }
+    {
+      // 後半は既存のキーと重なり、残りは新しいキー
+      iht::Draft draft(trie);
+      for(unsigned i=N/2; i < N + N/2; i++) {
+        draft.store(key_of(i).c_str(), value_of(i, 1));
+      }
+      CHECK(draft.size() == N);
+      trie.merge(draft, policy);
+    }
+
+    iht::View view(trie);
+    CHECK(view.size() == N + N/2);
+    for(unsigned i=0; i < N + N/2; i++) {
+      const bool from_draft = i >= N || (i >= N/2 && policy == iht::trie::PREFER_RIGHT);
+      CHECK(equals(view.find(key_of(i).c_str()), value_of(i, from_draft ? 1 : 0)));
+    }
+  }
+}
+
+void test_dump_restore(const std::string & dir) {
+  std::cout << "[dump/restore]" << std::endl;
+  const unsigned N = 20000;
+  const std::string path = dir + "/dump";
+  iht::HashTrie trie(64 * 1024 * 1024);
+  for(unsigned i=0; i < N; i++) {
+    trie.store(key_of(i).c_str(), value_of(i));
+  }
+  iht::View view(trie);
+  CHECK(view.dump(path));
+
+  iht::HashTrie restored(64 * 1024 * 1024);
+  CHECK(restored.restore(path));
+  iht::View restored_view(restored);
+  check_contents(restored_view, N, 0);
+
+  Collector expected, actual;
+  view.foreach(expected);
+  restored_view.foreach(actual);
+  CHECK(expected.entries == actual.entries);
+
+  // 壊れたファイルからは何も公開しない
+  CHECK(truncate(path.c_str(), 100) == 0);
+  iht::HashTrie broken(64 * 1024 * 1024);
+  CHECK(! broken.restore(path));
+  CHECK(broken.size() == 0);
+
+  unlink(path.c_str());
+}
+
+void test_freeze(const std::string & dir) {
+  std::cout << "[freeze]" << std::endl;
+  const unsigned N = 20000;
+  const std::string path = dir + "/frozen";
+  iht::HashTrie trie(64 * 1024 * 1024);
+  for(unsigned i=0; i < N; i++) {
+    trie.store(key_of(i).c_str(), value_of(i));
+  }
+  iht::View view(trie);
+  CHECK(view.freeze(path));
+
+  iht::FrozenTable table(path);
+  CHECK(table);
+  if(table) {
+    CHECK(table.size() == N);
+    for(unsigned i=0; i < N; i++) {
+      CHECK(equals(table.find(key_of(i).c_str()), value_of(i)));
+    }
+    CHECK(! table.isMember("no-such-key"));
+
+    Collector expected, actual;
+    view.foreach(expected);
+    table.foreach(actual);
+    CHECK(expected.entries == actual.entries);
+  }
+
+  // 途中で切れたファイルは開けない
+  CHECK(truncate(path.c_str(), 1000) == 0);
+  CHECK(! iht::FrozenTable(path));
+
+  unlink(path.c_str());
+}
+
+struct ReaderData {
+  iht::HashTrie * trie;
+  unsigned count;
+  unsigned failures;
+  unsigned snapshots;
+};
+
+// 書き込み側はキーを添字順に格納するので、どのrootでも size() 個の先頭のキーが揃っているはず
+void * do_read(void * p) {
+  ReaderData * data = reinterpret_cast<ReaderData*>(p);
+  iht::View view(*data->trie);
+  unsigned seed = 1;
+  size_t size = 0;
+  for(;;) {
+    view.updateIfNeed();
+    const size_t current = view.size();
+    if(current < size) {
+      data->failures++;
+    }
+    size = current;
+    data->snapshots++;
+
+    for(unsigned n=0; n < 100 && size > 0; n++) {
+      const unsigned i = rand_r(&seed) % size;
+      if(! equals(view.find(key_of(i).c_str()), value_of(i))) {
+        data->failures++;
+      }
+    }
+    if(size == data->count) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+void test_concurrent(const char * name, const iht::trie::ResizePolicy & policy) {
+  std::cout << "[concurrent reader/writer: " << name << "]" << std::endl;
+  const unsigned N = 20000;
+  const unsigned READER_NUM = 3;
+  iht::HashTrie trie(64 * 1024 * 1024, policy);
+
+  std::vector<pthread_t> threads(READER_NUM);
+  std::vector<ReaderData> datas(READER_NUM);
+  for(unsigned i=0; i < READER_NUM; i++) {
+    ReaderData d = {&trie, N, 0, 0};
+    datas[i] = d;
+    CHECK(pthread_create(&threads[i], NULL, do_read, &datas[i]) == 0);
+  }
+
+  for(unsigned i=0; i < N; i++) {
+    trie.store(key_of(i).c_str(), value_of(i));
+  }
+
+  for(unsigned i=0; i < READER_NUM; i++) {
+    pthread_join(threads[i], NULL);
+    CHECK(datas[i].failures == 0);
+  }
+
+  iht::View view(trie);
+  check_contents(view, N, 0);
+}
+
+void test_find_cache() {
+  std::cout << "[find cache]" << std::endl;
+
+  // 空のスロットは、世代やハッシュ値がどの値でも一致しない
+  iht::trie::FindCache empty(4);
+  CHECK(empty.find("", 0, 0) == NULL);
+  CHECK(empty.find("", 0, 0xFFFFFFFF) == NULL);
+
+  const unsigned N = 1000;
+  iht::HashTrie trie(64 * 1024 * 1024);
+  for(unsigned i=0; i < N; i++) {
+    trie.store(key_of(i).c_str(), value_of(i));
+  }
+
+  iht::View view(trie, 4);
+  for(unsigned n=0; n < 3; n++) {
+    for(unsigned i=0; i < N; i += 10) {
+      CHECK(equals(view.find(key_of(i).c_str()), value_of(i)));
+    }
+  }
+  CHECK(view.find("no-such-key").data() == String::invalid().data());
+
+  // 新しいrootを参照した後は、キャッシュに残っている古いエントリを返さない
+  for(unsigned i=0; i < N; i += 10) {
+    trie.store(key_of(i).c_str(), value_of(i, 1));
+  }
+  CHECK(equals(view.find(key_of(10).c_str()), value_of(10)));
+  view.updateIfNeed();
+  for(unsigned i=0; i < N; i += 10) {
+    CHECK(equals(view.find(key_of(i).c_str()), value_of(i, 1)));
+  }
+
+  iht::ThreadView thread_view(trie, 4);
+  CHECK(equals(thread_view.get().find(key_of(20).c_str()), value_of(20, 1)));
+  trie.store(key_of(20).c_str(), value_of(20, 2));
+  CHECK(equals(thread_view.get().find(key_of(20).c_str()), value_of(20, 2)));
+}
+
+void test_bloom_filter() {
+  std::cout << "[bloom filter]" << std::endl;
+  const unsigned N = 20000;
+  const iht::trie::ResizePolicy policy(4, 16, 4, 10);
+  iht::HashTrie trie(64 * 1024 * 1024, policy);
+  for(unsigned i=0; i < N/2; i++) {
+    trie.store(key_of(i).c_str(), value_of(i));
+  }
+
+  // 古いrootと共有しているフィルタへの追加や、フィルタの作り直しの後も、古いrootのキーは見つかる
+  iht::View old_view(trie);
+  for(unsigned i=N/2; i < N; i++) {
+    trie.store(key_of(i).c_str(), value_of(i));
+  }
+  check_contents(old_view, N/2, 0);
+
+  iht::View view(trie);
+  check_contents(view, N, 0);
+  unsigned misses = 0;
+  for(unsigned i=N; i < N*2; i++) {
+    misses += view.find(key_of(i).c_str()).data() == String::invalid().data();
+  }
+  CHECK(misses == N);
+
+  // マージ後のrootのフィルタにも、両側のキーが登録されている
+  {
+    iht::Draft draft(trie);
+    for(unsigned i=N; i < N + N/2; i++) {
+      draft.store(key_of(i).c_str(), value_of(i));
+    }
+    trie.merge(draft);
+  }
+  view.updateIfNeed();
+  check_contents(view, N + N/2, 0);
+}
+
+struct Point {
+  int32_t x;
+  int32_t y;
+};
+
+struct PointHash {
+  uint32_t operator()(const Point & p) const {
+    return iht::IntegerHash()((static_cast<uint64_t>(static_cast<uint32_t>(p.x)) << 32) | static_cast<uint32_t>(p.y));
+  }
+};
+
+void test_typed() {
+  std::cout << "[typed]" << std::endl;
+  const uint64_t N = 20000;
+  {
+    iht::TypedHashTrie<uint64_t, uint64_t> trie(64 * 1024 * 1024);
+    for(uint64_t i=0; i < N; i++) {
+      CHECK(trie.store(i * 7919, i));
+    }
+    CHECK(trie.store(7919, 12345)); // 上書き
+    CHECK(trie.size() == N);
+
+    iht::TypedHashTrie<uint64_t, uint64_t>::View view(trie);
+    uint64_t value = 0;
+    unsigned errors = 0;
+    for(uint64_t i=2; i < N; i++) {
+      errors += ! (view.find(i * 7919, value) && value == i);
+    }
+    CHECK(errors == 0);
+    CHECK(view.find(7919, value) && value == 12345);
+    CHECK(! view.member(7918));
+  }
+  {
+    iht::TypedHashTrie<int32_t, double> trie(16 * 1024 * 1024);
+    for(int32_t i=-1000; i < 1000; i++) {
+      trie.store(i, i * 0.5);
+    }
+    iht::TypedHashTrie<int32_t, double>::View view(trie);
+    double value = 0;
+    CHECK(view.find(-1000, value) && value == -500.0);
+    CHECK(view.find(999, value) && value == 499.5);
+    CHECK(! view.member(1000));
+  }
+  {
+    iht::TypedHashTrie<Point, uint32_t, PointHash> trie(16 * 1024 * 1024);
+    for(int32_t i=0; i < 100; i++) {
+      Point p = {i, -i};
+      trie.store(p, i);
+    }
+    iht::TypedHashTrie<Point, uint32_t, PointHash>::View view(trie);
+    Point p = {42, -42};
+    Point q = {42, 42};
+    uint32_t value = 0;
+    CHECK(view.find(p, value) && value == 42);
+    CHECK(! view.member(q));
+  }
+  {
+    // ハッシュ値が同じでも、8バイトのキーは全てのバイトを比べる
+    iht::HashTrie trie(16 * 1024 * 1024);
+    trie.store("abcdefgh", "1", 7);
+    trie.store("abcdefgi", "2", 7);
+    trie.store("abcd", "3", 7);
+    trie.store("abce", "4", 7);
+    iht::View view(trie);
+    CHECK(view.size() == 4);
+    CHECK(equals(view.find("abcdefgh", 7), "1"));
+    CHECK(equals(view.find("abcdefgi", 7), "2"));
+    CHECK(equals(view.find("abcd", 7), "3"));
+    CHECK(equals(view.find("abce", 7), "4"));
+    CHECK(view.find("abcdefgj", 7).data() == String::invalid().data());
+  }
+}
+
+// 容量制限の下で、共有メモリ領域の何倍ものエントリを格納し続けられるかどうか。
+// (追い出したエントリや上書きされたエントリの領域は、古いrootを参照する読み込み側がいなくなり次第回収される)
+void test_byte_budget() {
+  std::cout << "[byte budget]" << std::endl;
+  const size_t SEGMENT = 8 * 1024 * 1024;
+  iht::HashTrie trie(SEGMENT);
+  CHECK(trie.setByteBudget(SEGMENT / 4));
+
+  const unsigned N = 100000; // 値の合計はおよそ SEGMENT の 6 倍
+  const std::string hot = "hot-key";
+  CHECK(trie.store(hot.c_str(), "hot"));
+
+  unsigned failures = 0;
+  uint64_t bytes = 0;
+  for(unsigned i=0; i < N; i++) {
+    const std::string value = value_of(i) + std::string(400, 'x');
+    failures += ! trie.store(key_of(i).c_str(), value);
+    bytes += value.size();
+
+    // 検索され続けているエントリは追い出されない
+    iht::View view(trie);
+    CHECK(equals(view.find(hot.c_str()), "hot"));
+
+    if(i == N/2) {
+      // 古いrootを参照している読み込み側がいる間は、その内容は回収されない
+      iht::View old_view(trie);
+      const size_t old_size = old_view.size();
+      for(unsigned j=i+1; j < i+1000; j++) {
+        failures += ! trie.store(key_of(j).c_str(), value_of(j));
+      }
+      Collector collector;
+      old_view.foreach(collector);
+      CHECK(collector.entries.size() == old_size);
+      CHECK(equals(old_view.find(key_of(i).c_str()), value));
+    }
+  }
+  CHECK(bytes > 5 * SEGMENT);
+  CHECK(failures == 0);
+
+  iht::View view(trie);
+  CHECK(view.size() < N / 4);
+  CHECK(equals(view.find(key_of(N-1).c_str()), value_of(N-1) + std::string(400, 'x')));
+  CHECK(view.stats().value_bytes + view.stats().key_bytes <= SEGMENT / 4);
+}
+
+// 同じキーの上書きを繰り返しても、上書きされた値の領域が回収されるので共有メモリ領域は尽きない
+void test_overwrite_reclaim() {
+  std::cout << "[overwrite reclaim]" << std::endl;
+  const size_t SEGMENT = 4 * 1024 * 1024;
+  const iht::trie::ResizePolicy policy(4, 16, 8, 10, true); // ディレクトリ、フィルタ、索引も共有・回収される
+  iht::HashTrie trie(SEGMENT, policy);
+
+  const unsigned N = 1000;
+  unsigned failures = 0;
+  for(unsigned version=0; version < 100; version++) { // 値の合計はおよそ SEGMENT の 20 倍
+    for(unsigned i=0; i < N; i++) {
+      failures += ! trie.store(key_of(i).c_str(), value_of(i, version) + std::string(800, 'y'));
+    }
+  }
+  CHECK(failures == 0);
+
+  iht::View view(trie);
+  CHECK(view.size() == N);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(equals(view.find(key_of(i).c_str()), value_of(i, 99) + std::string(800, 'y')));
+  }
+}
+
+struct KeyPrefixCounter {
+  KeyPrefixCounter(const std::string & prefix) : prefix(prefix), matched(0), total(0) {}
+  void operator()(const String & key, const String & value) {
+    matched += std::string(key.data(), key.size()).compare(0, prefix.size(), prefix) == 0;
+    total++;
+  }
+  std::string prefix;
+  unsigned matched;
+  unsigned total;
+};
+
+void test_ttl_sweep() {
+  std::cout << "[ttl/sweep]" << std::endl;
+  const unsigned N = 5000;
+  iht::HashTrie trie(64 * 1024 * 1024);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(trie.storeWithTTL(("live-" + key_of(i)).c_str(), value_of(i), 3600));
+    CHECK(trie.storeWithTTL(("dead-" + key_of(i)).c_str(), value_of(i), 2));
+  }
+  sleep(3);
+
+  // 期限切れのエントリは、取り除かれる前から検索や stats()、foreach()、sample()、sketch() で見えない
+  iht::View view(trie);
+  CHECK(view.size() == 2 * N);
+  CHECK(view.stats().count == N);
+  for(unsigned i=0; i < N; i += 7) {
+    CHECK(equals(view.find(("live-" + key_of(i)).c_str()), value_of(i)));
+    CHECK(view.find(("dead-" + key_of(i)).c_str()).data() == String::invalid().data());
+  }
+  Collector collector;
+  view.foreach(collector);
+  CHECK(collector.entries.size() == N);
+
+  Random rng;
+  KeyPrefixCounter counter("live-");
+  view.sample(1000, rng, counter);
+  CHECK(counter.total == 1000 && counter.matched == 1000);
+  iht::Sketch sketch = view.sketch(1000, rng);
+  CHECK(sketch.population() == N && sketch.sampleCount() == 1000);
+
+  // 一巡すると打ち切られる
+  CHECK(trie.sweep(0xFFFFFFFF) == N);
+  CHECK(trie.sweep(0xFFFFFFFF) == 0);
+  CHECK(trie.size() == N);
+  view.updateIfNeed();
+  CHECK(view.stats().count == N);
+  CHECK(equals(view.find(("live-" + key_of(N-1)).c_str()), value_of(N-1)));
+
+  // 取り除いたエントリの領域は回収されるので、期限切れのエントリの格納と sweep() を繰り返しても共有メモリ領域は尽きない
+  // (ttl が 0 のエントリは格納した時点で期限切れになる)
+  const size_t SEGMENT = 4 * 1024 * 1024;
+  iht::HashTrie small(SEGMENT);
+  unsigned failures = 0;
+  for(unsigned round=0; round < 40; round++) { // 値の合計はおよそ SEGMENT の 20 倍
+    for(unsigned i=0; i < 2000; i++) {
+      failures += ! small.storeWithTTL(key_of(round * 2000 + i).c_str(), std::string(1000, 'z'), 0);
+    }
+    small.sweep(0xFFFFFFFF);
+  }
+  CHECK(failures == 0);
+  CHECK(small.size() == 0);
+}
+
+struct KeyList {
+  std::vector<std::string> keys;
+  void operator()(const String & key, const String & value) { keys.push_back(std::string(key.data(), key.size())); }
+};
+
+// [begin, end) の範囲のキーを、索引から列挙したものと std::set から求めたものとで比べる (end が NULL なら上限なし)
+bool scan_matches(const iht::View & view, const std::set<std::string> & keys, const std::string & begin, const std::string * end) {
+  KeyList list;
+  if(end == NULL) {
+    view.scanRange(begin, list);
+  } else {
+    view.scanRange(begin, *end, list);
+  }
+  std::vector<std::string> expected;
+  if(end == NULL || begin < *end) {
+    expected.assign(keys.lower_bound(begin), end == NULL ? keys.end() : keys.lower_bound(*end));
+  }
+  return list.keys == expected;
+}
+
+void test_ordered_index() {
+  std::cout << "[ordered index]" << std::endl;
+  const iht::trie::ResizePolicy policy(4, 16, 4, 0, true);
+  iht::HashTrie trie(64 * 1024 * 1024, policy);
+
+  std::set<std::string> keys;
+  const char * words[] = {"a", "ab", "abc", "abd", "b", "ba", "key-", ""};
+  for(size_t i=0; i < sizeof(words) / sizeof(words[0]); i++) {
+    keys.insert(words[i]);
+  }
+  keys.insert(std::string("a\0", 2)); // 短いキーが先に並び、末尾の '\0' とも区別される
+  char buf[32];
+  for(unsigned i=0; i < 2000; i++) {
+    sprintf(buf, "key-%04u", i);
+    keys.insert(buf);
+  }
+  for(std::set<std::string>::const_iterator it=keys.begin(); it != keys.end(); ++it) {
+    CHECK(trie.store(*it, "v"));
+  }
+
+  iht::View view(trie);
+  KeyList all;
+  CHECK(view.scanRange("", all));
+  CHECK(all.keys == std::vector<std::string>(keys.begin(), keys.end()));
+
+  // 空の範囲 (begin == end を含む)
+  const std::string abd = "abd", b = "b", abca = "abca";
+  CHECK(scan_matches(view, keys, "abd", &abd));
+  CHECK(scan_matches(view, keys, "c", &b));
+  CHECK(scan_matches(view, keys, "abca", &abd));
+  CHECK(scan_matches(view, keys, "abc", &abca));
+
+  // 格納されているキーの前方一致となる境界
+  const std::string key_001 = "key-001", key_1 = "key-1", key = "key-";
+  CHECK(scan_matches(view, keys, "key-00", &key_001));
+  CHECK(scan_matches(view, keys, "ab", &key_1));
+  CHECK(scan_matches(view, keys, "a", &key));
+  CHECK(scan_matches(view, keys, "key-0999", &key_1));
+
+  // 上限なし
+  CHECK(scan_matches(view, keys, "key-1990", NULL));
+  CHECK(scan_matches(view, keys, "key-2", NULL));
+  CHECK(scan_matches(view, keys, "zzz", NULL));
+
+  KeyList prefixed;
+  CHECK(view.scanPrefix("ab", prefixed));
+  CHECK(prefixed.keys.size() == 3 && prefixed.keys[0] == "ab" && prefixed.keys[2] == "abd");
+  KeyList hundreds;
+  view.scanPrefix("key-12", hundreds);
+  CHECK(hundreds.keys.size() == 100 && hundreds.keys[0] == "key-1200" && hundreds.keys[99] == "key-1299");
+
+  // 期限切れのエントリは取り除かれる前から列挙されず、取り除かれた後は索引からも除かれる (ttl が 0 なら格納した時点で期限切れ)
+  for(unsigned i=0; i < 100; i++) {
+    sprintf(buf, "exp-%04u", i);
+    CHECK(trie.storeWithTTL(buf, "v", 0));
+  }
+  view.updateIfNeed();
+  KeyList expired;
+  view.scanPrefix("exp-", expired);
+  CHECK(expired.keys.empty());
+  trie.sweep(0xFFFFFFFF);
+  view.updateIfNeed();
+  KeyList swept;
+  view.scanRange("", swept);
+  CHECK(swept.keys == all.keys);
+
+  // 追い出されたキーは列挙されない
+  iht::HashTrie cache(64 * 1024 * 1024, policy);
+  CHECK(cache.setByteBudget(64 * 1024));
+  for(unsigned i=0; i < 10000; i++) {
+    CHECK(cache.store(key_of(i).c_str(), value_of(i)));
+  }
+  iht::View cache_view(cache);
+  KeyList cached;
+  cache_view.scanRange("", cached);
+  CHECK(cached.keys.size() == cache_view.size() && cached.keys.size() < 10000);
+  unsigned found = 0;
+  for(size_t i=0; i < cached.keys.size(); i++) {
+    found += cache_view.find(cached.keys[i]).data() != String::invalid().data();
+  }
+  CHECK(found == cached.keys.size());
+}
+
+// threshold 以上の値はファイルに対応付けた領域に置かれ、共有メモリの大きさを越える量の値を保持できる
+void test_value_region(const std::string & dir) {
+  std::cout << "[value region]" << std::endl;
+  const size_t SEGMENT = 16 * 1024 * 1024;
+  const uint64_t REGION = 16 * 1024 * 1024;
+  const std::string shm_path = dir + "/shm";
+  const std::string region_path = dir + "/region";
+  const unsigned N = 4000; // 値の合計はおよそ 20MB
+
+  {
+    iht::HashTrie trie(SEGMENT, shm_path);
+    CHECK(trie.attachValueRegion(region_path, REGION, 1024));
+    unsigned failures = 0;
+    for(unsigned i=0; i < N; i++) {
+      failures += ! trie.store(key_of(i).c_str(), value_of(i) + std::string(5000, 'v'));
+    }
+    CHECK(failures == 0);
+
+    iht::View view(trie);
+    CHECK(view.size() == N);
+    for(unsigned i=0; i < N; i++) {
+      CHECK(equals(view.find(key_of(i).c_str()), value_of(i) + std::string(5000, 'v')));
+    }
+  }
+
+  // 同じファイルを対応付けた別のテーブル(別プロセスに相当)からも読める
+  {
+    iht::HashTrie trie(SEGMENT, shm_path);
+    CHECK(trie.attachValueRegion(region_path, REGION, 1024));
+    iht::View view(trie);
+    CHECK(view.size() == N);
+    for(unsigned i=0; i < N; i += 97) {
+      CHECK(equals(view.find(key_of(i).c_str()), value_of(i) + std::string(5000, 'v')));
+    }
+  }
+
+  // 対応付けられないファイルは false を返し、テーブルはそのまま使える
+  {
+    iht::HashTrie trie(SEGMENT);
+    CHECK(! trie.attachValueRegion(dir + "/no-such-dir/region", REGION, 1024));
+    CHECK(trie.store("key", std::string(5000, 'v')));
+    iht::View view(trie);
+    CHECK(equals(view.find("key"), std::string(5000, 'v')));
+  }
+
+  unlink(shm_path.c_str());
+  unlink(region_path.c_str());
+}
+
+// 繰り返しの多い値は圧縮して格納され、検索時に元の値に伸長される
+void test_value_codec() {
+  std::cout << "[value codec]" << std::endl;
+  const std::string common = "{\"name\":\"iht\",\"tags\":[\"shared\",\"memory\",\"hash\",\"trie\"],\"status\":\"active\"}";
+  const unsigned N = 5000;
+
+  std::vector<std::string> values;
+  Random rng;
+  uint64_t raw_bytes = 0;
+  for(unsigned i=0; i < N; i++) {
+    std::string value = value_of(i);
+    if(i % 10 == 0) {
+      // 圧縮しても小さくならない値はそのまま格納される
+      for(unsigned j=0; j < 100; j++) {
+        value += static_cast<char>(rng());
+      }
+    } else {
+      for(unsigned j=0; j < 10; j++) {
+        value += common;
+      }
+    }
+    values.push_back(value);
+    raw_bytes += value.size();
+  }
+
+  // 辞書ありの場合も含めて、圧縮と伸長で元に戻る
+  const iht::codec::LZ lz;
+  const iht::codec::LZ lz_dict(common.c_str());
+  CHECK(lz.id() != lz_dict.id());
+  for(unsigned i=1; i < N; i += 333) {
+    if(i % 10 == 0) {
+      continue;
+    }
+    std::string compressed, decompressed, compressed_dict, decompressed_dict;
+    CHECK(lz.compress(values[i], compressed));
+    CHECK(compressed.size() < values[i].size());
+    CHECK(lz.decompress(compressed, decompressed) && decompressed == values[i]);
+    CHECK(lz_dict.compress(values[i], compressed_dict));
+    CHECK(compressed_dict.size() < compressed.size());
+    CHECK(lz_dict.decompress(compressed_dict, decompressed_dict) && decompressed_dict == values[i]);
+  }
+
+  iht::HashTrie trie(64 * 1024 * 1024);
+  CHECK(trie.setValueCodec(&lz, 64));
+  CHECK(! trie.setValueCodec(&lz_dict, 64)); // 一度記録された方式とは異なる
+  for(unsigned i=0; i < N; i++) {
+    trie.store(key_of(i).c_str(), values[i]);
+  }
+
+  iht::View view(trie);
+  CHECK(view.size() == N);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(equals(view.find(key_of(i).c_str()), values[i]));
+  }
+  CHECK(view.stats().value_bytes < raw_bytes / 2);
+
+  // foreach() にも伸長した値が渡される
+  Collector collector;
+  view.foreach(collector);
+  CHECK(collector.entries.size() == N);
+  CHECK(collector.entries[key_of(N-1)] == values[N-1]);
+}
+
+// 同じ内容の値は一つの Blob にまとめられるので、値の合計が共有メモリ領域を越えても格納できる
+void test_dedup() {
+  std::cout << "[dedup]" << std::endl;
+  const size_t SEGMENT = 4 * 1024 * 1024;
+  const unsigned N = 20000; // 値の合計はおよそ 20MB
+  std::vector<std::string> values;
+  for(unsigned i=0; i < 8; i++) {
+    values.push_back(value_of(i) + std::string(1000, 'd'));
+  }
+
+  {
+    iht::HashTrie plain(SEGMENT);
+    unsigned failures = 0;
+    for(unsigned i=0; i < N; i++) {
+      failures += ! plain.store(key_of(i).c_str(), values[i % values.size()]);
+    }
+    CHECK(failures != 0);
+  }
+
+  iht::HashTrie trie(SEGMENT);
+  CHECK(! trie.enableDedup(128, 0));
+  CHECK(trie.enableDedup(128, 64));
+  unsigned failures = 0;
+  for(unsigned i=0; i < N; i++) {
+    failures += ! trie.store(key_of(i).c_str(), values[i % values.size()]);
+  }
+  CHECK(failures == 0);
+
+  // 共有している値を持つキーの上書きは、他のキーの値に影響しない
+  for(unsigned i=0; i < N; i += 3) {
+    failures += ! trie.store(key_of(i).c_str(), values[(i + 1) % values.size()]);
+  }
+  CHECK(failures == 0);
+
+  iht::View view(trie);
+  CHECK(view.size() == N);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(equals(view.find(key_of(i).c_str()), values[(i % 3 == 0 ? i + 1 : i) % values.size()]));
+  }
+}
+
+struct WaiterData {
+  iht::HashTrie * trie;
+  volatile int ready;
+  bool changed;
+  bool found;
+};
+
+// 格納される前のrootを参照してから、新しいrootが公開されるまで待つ
+void * do_wait(void * p) {
+  WaiterData * data = reinterpret_cast<WaiterData*>(p);
+  iht::View view(*data->trie);
+  __sync_synchronize();
+  data->ready = 1;
+  data->changed = view.waitForChange();
+  view.updateIfNeed();
+  data->found = equals(view.find("wake-up"), "now");
+  return NULL;
+}
+
+void test_wait_for_change() {
+  std::cout << "[wait for change]" << std::endl;
+  iht::HashTrie trie(8 * 1024 * 1024);
+  trie.store("key", "value");
+
+  // 何も公開されなければ timeout_us の経過後に false を返す
+  iht::View view(trie);
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  CHECK(! view.waitForChange(20000));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  CHECK((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000 >= 20000);
+
+  // 他のスレッドの store() で起こされる
+  WaiterData data = {&trie, 0, false, false};
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, do_wait, &data) == 0);
+  while(! data.ready) {
+    usleep(1000);
+  }
+  usleep(50000);
+  trie.store("wake-up", "now");
+  pthread_join(thread, NULL);
+  CHECK(data.changed);
+  CHECK(data.found);
+
+  // 既に新しいrootが公開されていれば待たずに true を返す
+  CHECK(view.waitForChange(0));
+  view.updateIfNeed();
+  CHECK(! view.waitForChange(0));
+}
+
+// ロック命令を使わない設定でも、格納・上書き・マージ・古いrootの回収が通常の設定と同じ結果になる
+void test_single_thread() {
+  std::cout << "[single thread]" << std::endl;
+  const unsigned N = 20000;
+  iht::HashTrie trie(64 * 1024 * 1024, iht::trie::ResizePolicy(), iht::atomic::SINGLE_THREAD);
+  CHECK(trie);
+  iht::View view(trie);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(trie.store(key_of(i).c_str(), value_of(i)));
+    if(i % 1000 == 0) {
+      view.updateIfNeed();
+      CHECK(view.size() == i + 1);
+    }
+  }
+  {
+    iht::Draft draft(trie);
+    for(unsigned i=0; i < N; i += 3) {
+      draft.store(key_of(i).c_str(), value_of(i, 1));
+    }
+    trie.merge(draft);
+  }
+  view.updateIfNeed();
+  CHECK(view.size() == N);
+  for(unsigned i=0; i < N; i++) {
+    CHECK(equals(view.find(key_of(i).c_str()), value_of(i, i % 3 == 0 ? 1 : 0)));
+  }
+
+  // 上書きされた値の領域が回収されるので、小さな共有メモリ領域でも尽きない
+  iht::HashTrie small(4 * 1024 * 1024, iht::trie::ResizePolicy(), iht::atomic::SINGLE_THREAD);
+  unsigned failures = 0;
+  for(unsigned version=0; version < 50; version++) {
+    for(unsigned i=0; i < 1000; i++) {
+      failures += ! small.store(key_of(i).c_str(), value_of(i, version));
+    }
+  }
+  CHECK(failures == 0);
+  iht::View small_view(small);
+  check_contents(small_view, 1000, 49);
+}
+
+// 選ばれたエントリが格納したものと一致するかどうかを数える
+struct SampleChecker {
+  SampleChecker() : mismatched(0), total(0) {}
+  void operator()(const String & key, const String & value) {
+    const std::string k(key.data(), key.size());
+    const unsigned i = atoi(k.c_str() + 4);
+    mismatched += k != key_of(i) || ! equals(value, value_of(i));
+    distinct.insert(k);
+    total++;
+  }
+  unsigned mismatched;
+  unsigned total;
+  std::set<std::string> distinct;
+};
+
+void test_sample_sketch() {
+  std::cout << "[sample/sketch]" << std::endl;
+  const unsigned N = 20000;
+  iht::HashTrie trie(64 * 1024 * 1024);
+  Random rng;
+  {
+    // 空のテーブルからは何も選ばれない
+    iht::View view(trie);
+    SampleChecker checker;
+    view.sample(100, rng, checker);
+    CHECK(checker.total == 0);
+    CHECK(view.sketch(100, rng).population() == 0);
+  }
+
+  uint64_t value_bytes = 0;
+  for(unsigned i=0; i < N; i++) {
+    trie.store(key_of(i).c_str(), value_of(i));
+    value_bytes += value_of(i).size();
+  }
+  iht::View view(trie);
+
+  // 一様に選ばれていれば、N 回の復元抽出で異なるエントリはおよそ N*(1-1/e) 個になる
+  SampleChecker checker;
+  view.sample(N, rng, checker);
+  CHECK(checker.total == N);
+  CHECK(checker.mismatched == 0);
+  CHECK(checker.distinct.size() > N / 2 && checker.distinct.size() < N * 3 / 4);
+
+  iht::Sketch sketch = view.sketch(N, rng);
+  CHECK(sketch.population() == N);
+  CHECK(sketch.sampleCount() == N);
+  const double mean = static_cast<double>(value_bytes) / N;
+  CHECK(sketch.meanValueSize() > mean * 0.8 && sketch.meanValueSize() < mean * 1.2);
+  CHECK(sketch.valueSizePercentile(50) >= 16 && sketch.valueSizePercentile(50) <= 28);
+  CHECK(sketch.valueSizePercentile(100) == 5000);
+
+  // "key-1000" 以降のキーは長さ 8 以上 ([8, 16) の要素)
+  const std::vector<double> & histogram = sketch.keyLengthHistogram();
+  CHECK(histogram[4] > 0.9 && histogram[4] < 1.0);
+  CHECK(histogram[3] + histogram[4] > 0.999);
+}
+
+int main() {
+  char dir[] = "/tmp/iht-test-XXXXXX";
+  if(mkdtemp(dir) == NULL) {
+    std::cerr << "mkdtemp failed" << std::endl;
+    return 1;
+  }
+
+  test_store_find();
+  test_merge();
+  test_dump_restore(dir);
+  test_freeze(dir);
+  test_concurrent("default", iht::trie::ResizePolicy());
+  test_concurrent("bloom filter", iht::trie::ResizePolicy(4, 16, 4, 10));
+  test_find_cache();
+  test_bloom_filter();
+  test_typed();
+  test_byte_budget();
+  test_overwrite_reclaim();
+  test_ttl_sweep();
+  test_ordered_index();
+  test_value_region(dir);
+  test_value_codec();
+  test_dedup();
+  test_wait_for_change();
+  test_single_thread();
+  test_sample_sketch();
+
+  rmdir(dir);
+  if(g_failures != 0) {
+    std::cout << g_failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  std::cout << "all checks passed" << std::endl;
+  return 0;
+}